@@ -0,0 +1,32 @@
+#ifndef INCLUDE_ILLUMINATA_CONTEXT_HPP
+#define INCLUDE_ILLUMINATA_CONTEXT_HPP
+
+#include <thread>
+
+#include "illuminata/mupdf.hpp"
+
+namespace illa {
+// A MuPDF context must not be used by several threads at once. `mupdfcpp` creates a base context
+// with locking callbacks (`fz_locks_context`) guarding the state shared between contexts, such as
+// the store and the glyph cache, and gives each thread its own clone of it (`fz_clone_context`),
+// which is dropped when the thread exits. It falls back to one context without locks for all
+// threads if it is switched to single-threaded mode, e.g. by setting the environment variable
+// `MUPDF_mt_ctx` to 0.
+//
+// On top of that, Illuminata relies on the following to use MuPDF on several threads:
+// - Documents and their pages are only used by one thread at a time (see `PageCache`).
+// - Display lists do not refer to their document and are only read after being built,
+//   so they are run concurrently by the render worker and its thread pool.
+// - Pixmaps are only written by one thread at a time, or in disjoint bands.
+
+// Whether each thread uses its own MuPDF context, which is required by the above. Checked once
+// at startup by comparing the context of the calling thread to that of another thread.
+inline bool thread_contexts() {
+  fz_context* const own = mupdf::internal_context_get();
+  fz_context* other = nullptr;
+  std::thread{[&] { other = mupdf::internal_context_get(); }}.join();
+  return own != other;
+}
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_CONTEXT_HPP
@@ -2,11 +2,15 @@
 #define INCLUDE_ILLUMINATA_ILLUMINATA_HPP
 
 // IWYU pragma: begin_exports
+#include "context.hpp"
 #include "fmt.hpp"
 #include "geometry.hpp"
+#include "log.hpp"
 #include "mupdf.hpp"
 #include "opengl.hpp"
 #include "pdf.hpp"
+#include "queue.hpp"
+#include "threads.hpp"
 // IWYU pragma: end_exports
 
 #endif // INCLUDE_ILLUMINATA_ILLUMINATA_HPP
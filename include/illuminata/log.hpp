@@ -0,0 +1,17 @@
+#ifndef INCLUDE_ILLUMINATA_LOG_HPP
+#define INCLUDE_ILLUMINATA_LOG_HPP
+
+#include <utility>
+
+#include "illuminata/fmt.hpp"
+
+namespace illa {
+template<typename... T>
+inline void log([[maybe_unused]] fmt::format_string<T...> fmt, [[maybe_unused]] T&&... args) {
+#if ILLUMINATA_PRINT
+  fmt::print(fmt, std::forward<T>(args)...);
+#endif
+}
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_LOG_HPP
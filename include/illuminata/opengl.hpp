@@ -1,12 +1,16 @@
 #ifndef INCLUDE_ILLUMINATA_OPENGL_HPP
 #define INCLUDE_ILLUMINATA_OPENGL_HPP
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <initializer_list>
 #include <memory>
 #include <stdexcept>
 #include <string_view>
+#include <vector>
 
 // IWYU pragma: begin_exports
 #include <epoxy/gl.h>
@@ -62,6 +66,14 @@ enum struct PixelFormat {
   rgba = GL_RGBA,
 };
 
+// The sized internal formats for immutable texture storage.
+enum struct InternalFormat {
+  r8 = GL_R8,
+  rg8 = GL_RG8,
+  rgb8 = GL_RGB8,
+  rgba8 = GL_RGBA8,
+};
+
 enum struct PixelKind {
   u8 = GL_UNSIGNED_BYTE,
   i8 = GL_BYTE,
@@ -83,6 +95,11 @@ struct Shader {
     source(src);
     compile();
   }
+  // A shader whose source is the concatenation of `srcs`, e.g. to share declarations.
+  Shader(ShaderKind kind, std::initializer_list<std::string_view> srcs) : Shader{kind} {
+    source(srcs);
+    compile();
+  }
 
   Shader(const Shader&) = delete;
   Shader(Shader&& other) noexcept : id_(other.id_), kind_(other.kind_) {
@@ -101,6 +118,15 @@ struct Shader {
     auto len = static_cast<GLint>(src.size());
     glShaderSource(id_, 1, &data, &len);
   }
+  void source(std::initializer_list<std::string_view> srcs) {
+    std::vector<const char*> data{};
+    std::vector<GLint> lens{};
+    for (const std::string_view src : srcs) {
+      data.push_back(src.data());
+      lens.push_back(static_cast<GLint>(src.size()));
+    }
+    glShaderSource(id_, static_cast<GLsizei>(data.size()), data.data(), lens.data());
+  }
   void compile() {
     glCompileShader(id_);
 
@@ -157,7 +183,9 @@ struct Texture {
     assert(id_ != 0);
   }
   Texture(const Texture&) = delete;
-  Texture(Texture&& other) noexcept : id_{other.id_}, kind_{other.kind_} {
+  Texture(Texture&& other) noexcept
+      : id_{other.id_}, kind_{other.kind_}, width_{other.width_}, height_{other.height_},
+        layers_{other.layers_} {
     other.id_ = 0;
   }
   Texture& operator=(const Texture&) = delete;
@@ -172,15 +200,58 @@ struct Texture {
     return TextureBindCtx{id_, kind_};
   }
 
-  void load(const std::uint8_t* data, GLsizei w, GLsizei h, PixelFormat format) {
-    assert(kind_ == TextureKind::TEXTURE_2D);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexImage2D(static_cast<GLenum>(kind_), 0, static_cast<GLint>(format), w, h, 0,
-                 static_cast<GLenum>(format), GL_UNSIGNED_BYTE, data);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  // Allocate immutable storage for `layers` layers of `w`×`h` texels of a 2D array texture
+  // with `levels` mipmap levels. Requires the texture to be bound.
+  void allocate_layers(GLsizei w, GLsizei h, GLsizei layers, InternalFormat format,
+                       GLsizei levels = 1) {
+    assert(kind_ == TextureKind::texture_2d_array);
+    glTexStorage3D(static_cast<GLenum>(kind_), levels, static_cast<GLenum>(format), w, h, layers);
+    width_ = w;
+    height_ = h;
+    layers_ = layers;
+  }
+
+  // Replace the `w`×`h` texels at (`x`, `y`) of layer `layer` of a 2D array texture by `data`,
+  // whose rows are `row_length` pixels apart. Requires the texture to be bound, its storage to be
+  // allocated, and the rows to be aligned to four bytes (the default unpack alignment).
+  void update_layer(const std::uint8_t* data, GLint x, GLint y, GLint layer, GLsizei w, GLsizei h,
+                    GLint row_length, PixelFormat format) {
+    assert(kind_ == TextureKind::texture_2d_array);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+    glTexSubImage3D(static_cast<GLenum>(kind_), 0, x, y, layer, w, h, 1,
+                    static_cast<GLenum>(format), GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  }
+
+  // Compute the mipmap levels below the base level from the base level, e.g. after updating it.
+  // Requires the texture to be bound and its storage to have all levels.
+  void generate_mipmaps() {
+    glGenerateMipmap(static_cast<GLenum>(kind_));
+  }
+
+  // Set the sampler state, which is part of the texture and only needs to be set once.
+  // Requires the texture to be bound.
+  void set_sampling(GLint filter, GLint wrap) {
+    set_sampling(filter, filter, wrap);
+  }
+  // Like the above, with separate filters for minification and magnification, e.g.
+  // `GL_LINEAR_MIPMAP_LINEAR` and `GL_LINEAR` for trilinear filtering.
+  void set_sampling(GLint min_filter, GLint mag_filter, GLint wrap) {
+    const auto target = static_cast<GLenum>(kind_);
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, wrap);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, min_filter);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, mag_filter);
+  }
+
+  // Set the source components of the components returned when sampling the texture,
+  // e.g. to swap red and blue. Requires the texture to be bound.
+  void set_swizzle(GLint r, GLint g, GLint b, GLint a) {
+    const auto target = static_cast<GLenum>(kind_);
+    glTexParameteri(target, GL_TEXTURE_SWIZZLE_R, r);
+    glTexParameteri(target, GL_TEXTURE_SWIZZLE_G, g);
+    glTexParameteri(target, GL_TEXTURE_SWIZZLE_B, b);
+    glTexParameteri(target, GL_TEXTURE_SWIZZLE_A, a);
   }
 
   [[nodiscard]] GLuint id() const {
@@ -189,10 +260,45 @@ struct Texture {
   [[nodiscard]] TextureKind kind() const {
     return kind_;
   }
+  // The dimensions of the storage, which are 0 if it has not been allocated.
+  [[nodiscard]] GLsizei width() const {
+    return width_;
+  }
+  [[nodiscard]] GLsizei height() const {
+    return height_;
+  }
+  // The number of layers of an array texture, which is 0 if its storage has not been allocated.
+  [[nodiscard]] GLsizei layers() const {
+    return layers_;
+  }
+
+  // The maximum number of layers of an array texture supported by the GL.
+  static GLsizei max_layers() {
+    GLint layers{};
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &layers);
+    return layers;
+  }
+  // The maximum width and height of a texture supported by the GL.
+  static GLsizei max_size() {
+    GLint size{};
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &size);
+    return size;
+  }
+  // The number of levels of a full mip chain for `w`×`h` texels, down to 1×1.
+  static GLsizei mip_levels(GLsizei w, GLsizei h) {
+    GLsizei levels = 1;
+    for (GLsizei size = std::max(w, h); size > 1; size /= 2) {
+      ++levels;
+    }
+    return levels;
+  }
 
 private:
   GLuint id_{};
   TextureKind kind_;
+  GLsizei width_{0};
+  GLsizei height_{0};
+  GLsizei layers_{0};
 };
 
 struct TextureUnit {
@@ -245,6 +351,170 @@ private:
   BufferBindingTarget target_;
 };
 
+// A buffer object for vertex or uniform data.
+struct Buffer {
+  explicit Buffer(BufferBindingTarget target) : target_{target} {
+    glGenBuffers(1, &id_);
+    assert(id_ != 0);
+  }
+  Buffer(const Buffer&) = delete;
+  Buffer(Buffer&& other) noexcept : id_{other.id_}, target_{other.target_} {
+    other.id_ = 0;
+  }
+  Buffer& operator=(const Buffer&) = delete;
+  Buffer& operator=(Buffer&&) = delete;
+  ~Buffer() {
+    if (id_ != 0) {
+      glDeleteBuffers(1, &id_);
+    }
+  }
+
+  VertexBufferBind bind() {
+    return VertexBufferBind{id_, target_};
+  }
+
+  // Replace the contents of the buffer by `size` bytes from `data`.
+  // Requires the buffer to be bound.
+  void data(const void* data, GLsizeiptr size, GLenum usage) {
+    glBufferData(static_cast<GLenum>(target_), size, data, usage);
+  }
+
+  // Bind the buffer to the indexed binding point `index` of its target, e.g. of a uniform block.
+  void bind_base(GLuint index) {
+    glBindBufferBase(static_cast<GLenum>(target_), index, id_);
+  }
+
+  [[nodiscard]] GLuint id() const {
+    return id_;
+  }
+
+private:
+  GLuint id_{};
+  BufferBindingTarget target_;
+};
+
+// A buffer from which pixel data is transferred into textures, which happens asynchronously
+// once the transfer has been issued instead of blocking until the data has been copied.
+struct PixelBuffer {
+  PixelBuffer() {
+    glGenBuffers(1, &id_);
+    assert(id_ != 0);
+  }
+  PixelBuffer(const PixelBuffer&) = delete;
+  PixelBuffer(PixelBuffer&& other) noexcept : id_{other.id_}, size_{other.size_} {
+    other.id_ = 0;
+  }
+  PixelBuffer& operator=(const PixelBuffer&) = delete;
+  PixelBuffer& operator=(PixelBuffer&&) = delete;
+  ~PixelBuffer() {
+    if (id_ != 0) {
+      glDeleteBuffers(1, &id_);
+    }
+  }
+
+  VertexBufferBind bind() {
+    return VertexBufferBind{id_, BufferBindingTarget::pixel_unpack_buffer};
+  }
+
+  // Copy `size` bytes from `data` into the buffer, growing it if necessary.
+  // Requires the buffer to be bound and the GL to have finished reading from it,
+  // since the buffer is mapped without synchronization.
+  void write(const void* data, GLsizeiptr size) {
+    const auto target = static_cast<GLenum>(BufferBindingTarget::pixel_unpack_buffer);
+    if (size > size_) {
+      glBufferData(target, size, nullptr, GL_STREAM_DRAW);
+      size_ = size;
+    }
+    void* dst = glMapBufferRange(
+      target, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (dst == nullptr) {
+      throw std::runtime_error{"An error occured while mapping the pixel buffer."};
+    }
+    std::memcpy(dst, data, static_cast<std::size_t>(size));
+    glUnmapBuffer(target);
+  }
+
+  // Whether buffers can be mapped persistently, which requires immutable buffer storage.
+  static bool persistent_mapping_supported() {
+    return (epoxy_is_desktop_gl() && epoxy_gl_version() >= 44) ||
+           epoxy_has_gl_extension("GL_ARB_buffer_storage") ||
+           epoxy_has_gl_extension("GL_EXT_buffer_storage");
+  }
+
+  // Allocate immutable storage of `size` bytes and map it persistently and coherently,
+  // so that it can be written to at any time, including by other threads, while the GL reads
+  // from it. The mapping remains valid until the buffer is deleted.
+  // Requires the buffer to be bound and not to have been allocated before.
+  unsigned char* allocate_persistent(GLsizeiptr size) {
+    const auto target = static_cast<GLenum>(BufferBindingTarget::pixel_unpack_buffer);
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(target, size, nullptr, flags);
+    void* data = glMapBufferRange(target, 0, size, flags);
+    if (data == nullptr) {
+      throw std::runtime_error{"An error occured while mapping the pixel buffer persistently."};
+    }
+    size_ = size;
+    return static_cast<unsigned char*>(data);
+  }
+
+  [[nodiscard]] GLuint id() const {
+    return id_;
+  }
+
+private:
+  GLuint id_{};
+  GLsizeiptr size_{0};
+};
+
+// A fence that is signaled once the GL commands issued before its creation have completed.
+struct Fence {
+  Fence() : sync_{glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)} {
+    if (sync_ == nullptr) {
+      throw std::runtime_error{"An error occured while creating the fence."};
+    }
+  }
+  Fence(const Fence&) = delete;
+  Fence(Fence&& other) noexcept : sync_{other.sync_} {
+    other.sync_ = nullptr;
+  }
+  Fence& operator=(const Fence&) = delete;
+  Fence& operator=(Fence&&) = delete;
+  ~Fence() {
+    if (sync_ != nullptr) {
+      glDeleteSync(sync_);
+    }
+  }
+
+  // Whether the fence is signaled, without blocking.
+  [[nodiscard]] bool signaled() const {
+    GLint status{};
+    glGetSynciv(sync_, GL_SYNC_STATUS, 1, nullptr, &status);
+    return status == GL_SIGNALED;
+  }
+
+  // Make the GL wait for the fence before executing the commands issued in the current context
+  // afterwards, without blocking, e.g. for a fence created in another context sharing it.
+  // Requires the commands before the fence to have been flushed in its context.
+  void gpu_wait() const {
+    glWaitSync(sync_, 0, GL_TIMEOUT_IGNORED);
+  }
+
+  // Block until the fence is signaled, flushing the commands before it if necessary.
+  void wait() {
+    while (true) {
+      switch (glClientWaitSync(sync_, GL_SYNC_FLUSH_COMMANDS_BIT, 1'000'000)) {
+      case GL_ALREADY_SIGNALED:
+      case GL_CONDITION_SATISFIED: return;
+      case GL_WAIT_FAILED: throw std::runtime_error{"An error occured while waiting for a fence."};
+      default: break;
+      }
+    }
+  }
+
+private:
+  GLsync sync_;
+};
+
 struct VertexArray {
   VertexArray() {
     glGenVertexArrays(1, &id_);
@@ -258,7 +528,7 @@ struct VertexArray {
   VertexArray& operator=(VertexArray&&) = delete;
   ~VertexArray() {
     if (id_ != 0) {
-      glDeleteBuffers(1, &id_);
+      glDeleteVertexArrays(1, &id_);
     }
   }
 
@@ -336,6 +606,11 @@ struct Program {
     return glGetUniformLocation(id_, name);
   }
 
+  // Use the buffer bound to uniform buffer binding point `binding` for the uniform block `name`.
+  void bind_uniform_block(const char* name, GLuint binding) {
+    glUniformBlockBinding(id_, glGetUniformBlockIndex(id_, name), binding);
+  }
+
   void detach(const gl::Shader& shader) {
     glDetachShader(id_, shader.id());
   }
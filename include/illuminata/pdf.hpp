@@ -2,10 +2,18 @@
 #define INCLUDE_ILLUMINATA_PDF_HPP
 
 // IWYU pragma: begin_exports
+#include "pdf/atlas.hpp"
 #include "pdf/info.hpp"
 #include "pdf/opengl.hpp"
+#include "pdf/pixmaps.hpp"
+#include "pdf/render.hpp"
+#include "pdf/staging.hpp"
+#include "pdf/textures.hpp"
+#include "pdf/tiles.hpp"
 #include "pdf/transform.hpp"
+#include "pdf/upload.hpp"
 #include "pdf/window.hpp"
+#include "pdf/worker.hpp"
 // IWYU pragma: end_exports
 
 #endif // INCLUDE_ILLUMINATA_PDF_HPP
@@ -0,0 +1,226 @@
+#ifndef INCLUDE_ILLUMINATA_PDF_ATLAS_HPP
+#define INCLUDE_ILLUMINATA_PDF_ATLAS_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "illuminata/mupdf.hpp"
+#include "illuminata/pdf/render.hpp"
+#include "illuminata/pdf/tiles.hpp"
+
+namespace illa {
+// The edge length of the square tiles of the texture atlas (in pixels).
+// Larger than the tiles of the render worker, since GLES only guarantees 256 layers per array
+// texture, which then cover a 4K view including overscan at a device scale of two.
+inline constexpr int atlas_tile_size = 2 * tile_size;
+
+// The part `rect` (pixel coordinates) of a tile held by layer `layer` of the atlas.
+struct AtlasPart {
+  int layer;
+  mupdf::FzIrect rect;
+};
+
+// The result of placing a frame in the atlas.
+struct TilePlacement {
+  // The parts of the frame to upload, i.e. those not resident before.
+  std::vector<AtlasPart> uploads;
+  // The parts of the frame held by the atlas, one per tile.
+  std::vector<AtlasPart> parts;
+};
+
+// Keeps track of the tiles of the rasters of pages held by the layers of a texture atlas,
+// with one tile per layer, so that frames are uploaded tile by tile and the parts of a frame that
+// are already resident, e.g. after panning or when returning to a zoom level, are not uploaded
+// again. Since frames do not cover whole tiles at their edges, each tile records the part of it
+// that has been uploaded. If all layers are occupied, the least recently used tiles are evicted,
+// except for those in pinned layers, e.g. since a frame that may be drawn uses them.
+// The texture itself is managed by the owner.
+struct TileAtlas {
+  TileAtlas() = default;
+  TileAtlas(const TileAtlas&) = delete;
+  TileAtlas(TileAtlas&&) = delete;
+  TileAtlas& operator=(const TileAtlas&) = delete;
+  TileAtlas& operator=(TileAtlas&&) = delete;
+  ~TileAtlas() = default;
+
+  // The number of layers needed to hold the tiles resident now and those of the frame covering
+  // `box` that are not.
+  [[nodiscard]] std::size_t layers_needed(const mupdf::FzDisplayList& list, float factor,
+                                          const mupdf::FzIrect& box) const {
+    std::size_t needed = lru_.size();
+    for_each_tile(list, factor, box, [&](const TileKey& key, const mupdf::FzIrect& /*part*/) {
+      needed += index_.contains(key) ? 0 : 1;
+    });
+    return needed;
+  }
+
+  // Add the layers from `layers()` to `layers - 1`, which have to be allocated by the owner.
+  void grow(int layers) {
+    for (int layer = layers - 1; layer >= layers_; --layer) {
+      free_.push_back(layer);
+    }
+    layers_ = std::max(layers_, layers);
+    pins_.resize(std::size_t(layers_), 0);
+  }
+
+  // Make the tiles of the frame covering `box` of the raster of `list` at `factor` resident.
+  // If there are not enough layers that are free or hold tiles that can be evicted, only the first
+  // tiles are made resident if `partial` is true, and nothing is changed and `std::nullopt` is
+  // returned otherwise.
+  [[nodiscard]] std::optional<TilePlacement> place(mupdf::FzDisplayList& list, float factor,
+                                                   const mupdf::FzIrect& box, bool partial) {
+    std::vector<std::pair<Lru::iterator, mupdf::FzIrect>> hits{};
+    std::vector<std::pair<TileKey, mupdf::FzIrect>> missing{};
+    for_each_tile(list, factor, box, [&](const TileKey& key, const mupdf::FzIrect& part) {
+      if (auto it = index_.find(key); it != index_.end()) {
+        hits.emplace_back(it->second, part);
+      } else {
+        missing.emplace_back(key, part);
+      }
+    });
+
+    // The layers available for the missing tiles, which are free or hold tiles that are neither
+    // pinned nor part of the frame.
+    std::size_t available = free_.size();
+    for (const Entry& entry : lru_) {
+      available += pinned(entry.layer) ? 0 : 1;
+    }
+    for (const auto& [it, part] : hits) {
+      available -= pinned(it->layer) ? 0 : 1;
+    }
+    if (!partial && missing.size() > available) {
+      return std::nullopt;
+    }
+
+    TilePlacement out{};
+    for (const auto& [it, part] : hits) {
+      Entry& entry = *it;
+      lru_.splice(lru_.begin(), lru_, it);
+      for (const mupdf::FzIrect& r : subtract(part, entry.valid)) {
+        out.uploads.push_back(AtlasPart{.layer = entry.layer, .rect = r});
+      }
+      entry.valid = merge(entry.valid, part);
+      out.parts.push_back(AtlasPart{.layer = entry.layer, .rect = part});
+    }
+
+    // The first unpinned tile from the back is never one of the frame as long as layers are
+    // available, since those have been moved to the front.
+    for (const auto& [key, part] : missing) {
+      if (available == 0) {
+        break;
+      }
+      --available;
+      int layer{};
+      if (!free_.empty()) {
+        layer = free_.back();
+        free_.pop_back();
+      } else {
+        auto victim = std::prev(lru_.end());
+        while (pinned(victim->layer)) {
+          --victim;
+        }
+        layer = victim->layer;
+        index_.erase(victim->key);
+        lru_.erase(victim);
+      }
+      lru_.push_front(Entry{.key = key, .list = list, .valid = part, .layer = layer});
+      index_.insert_or_assign(key, lru_.begin());
+      out.uploads.push_back(AtlasPart{.layer = layer, .rect = part});
+      out.parts.push_back(AtlasPart{.layer = layer, .rect = part});
+    }
+    return out;
+  }
+
+  // Pin the layers of `parts`, which are not evicted until they are unpinned as often.
+  void pin(const std::vector<AtlasPart>& parts) {
+    for (const AtlasPart& part : parts) {
+      ++pins_[std::size_t(part.layer)];
+    }
+  }
+  void unpin(const std::vector<AtlasPart>& parts) {
+    for (const AtlasPart& part : parts) {
+      --pins_[std::size_t(part.layer)];
+    }
+  }
+
+  // Drop all tiles and layers, e.g. since the texture has been deleted.
+  void clear() {
+    layers_ = 0;
+    free_.clear();
+    pins_.clear();
+    index_.clear();
+    lru_.clear();
+  }
+
+  [[nodiscard]] int layers() const {
+    return layers_;
+  }
+  [[nodiscard]] std::size_t size() const {
+    return lru_.size();
+  }
+
+private:
+  struct Entry {
+    TileKey key;
+    // Keeps the display list alive so that its address cannot be reused for another one.
+    mupdf::FzDisplayList list;
+    // The part of the tile that has been uploaded (pixel coordinates).
+    mupdf::FzIrect valid;
+    int layer;
+  };
+  using Lru = std::list<Entry>;
+
+  [[nodiscard]] bool pinned(int layer) const {
+    return pins_[std::size_t(layer)] > 0;
+  }
+
+  // Call `f` with the key of each tile overlapping `box` and the part of `box` it covers.
+  template<typename TF>
+  static void for_each_tile(const mupdf::FzDisplayList& list, float factor,
+                            const mupdf::FzIrect& box, TF f) {
+    if (is_empty(box)) {
+      return;
+    }
+    const int level = zoom_level(factor);
+    for (int ty = floor_div(box.y0, atlas_tile_size); ty * atlas_tile_size < box.y1; ++ty) {
+      for (int tx = floor_div(box.x0, atlas_tile_size); tx * atlas_tile_size < box.x1; ++tx) {
+        const mupdf::FzIrect tile{tx * atlas_tile_size, ty * atlas_tile_size,
+                                  (tx + 1) * atlas_tile_size, (ty + 1) * atlas_tile_size};
+        f(TileKey{.list = list.m_internal, .level = level, .x = tx, .y = ty},
+          intersect(tile, box));
+      }
+    }
+  }
+
+  // The part of a tile known to be uploaded after uploading `b` into a tile whose uploaded part
+  // is `a`, which is their union if it is a rectangle and the larger one of them otherwise.
+  static mupdf::FzIrect merge(const mupdf::FzIrect& a, const mupdf::FzIrect& b) {
+    const auto area = [](const mupdf::FzIrect& r) {
+      return is_empty(r) ? std::size_t{0} : std::size_t(r.x1 - r.x0) * std::size_t(r.y1 - r.y0);
+    };
+    const mupdf::FzIrect hull{std::min(a.x0, b.x0), std::min(a.y0, b.y0), std::max(a.x1, b.x1),
+                              std::max(a.y1, b.y1)};
+    if (area(hull) + area(intersect(a, b)) == area(a) + area(b)) {
+      return hull;
+    }
+    return area(a) >= area(b) ? a : b;
+  }
+
+  int layers_{0};
+  // The layers not holding a tile.
+  std::vector<int> free_{};
+  // The number of times each layer is pinned.
+  std::vector<std::size_t> pins_{};
+  // The resident tiles, most recently used first.
+  Lru lru_{};
+  std::unordered_map<TileKey, Lru::iterator, TileKeyHash> index_{};
+};
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_PDF_ATLAS_HPP
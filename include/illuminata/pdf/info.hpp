@@ -2,8 +2,18 @@
 #define INCLUDE_ILLUMINATA_PDF_INFO_HPP
 
 #include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
 #include <filesystem>
+#include <functional>
+#include <list>
+#include <mutex>
 #include <optional>
+#include <stop_token>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 
 #include <gdk/gdk.h>
@@ -15,57 +25,303 @@
 #include <gtkmm.h>
 #include <libadwaitamm.h>
 
-#include "illuminata/mupdf.hpp"
-
-#if ILLUMINATA_PRINT
 #include "illuminata/fmt.hpp"
-#endif
+#include "illuminata/geometry.hpp"
+#include "illuminata/log.hpp"
+#include "illuminata/mupdf.hpp"
 
 namespace illa {
-// Information about a page in a PDF document relevant for rendering it.
+// Information about a page in a PDF document relevant for rendering it, which does not refer to
+// the document, so that it can be used and dropped on any thread.
 struct PdfPageInfo {
-  mupdf::FzPage page;
   mupdf::FzDisplayList display_list;
+  // The page bounds, cached so that they are available without accessing the document,
+  // which may be in use by the prefetching thread.
+  Rect<float> bounds;
+
+  // Load page `pno` of `doc`, which is only accessed by this call and has to be guarded by the
+  // caller. The page itself is dropped before returning.
+  static PdfPageInfo load(mupdf::FzDocument& doc, int pno) {
+    log("load page {}\n", pno);
+    mupdf::FzPage p = doc.fz_load_page(pno);
+    auto list = p.fz_new_display_list_from_page();
+    const Rect bounds{p.fz_bound_page()};
+    return PdfPageInfo{.display_list = std::move(list), .bounds = bounds};
+  }
+};
+
+// The parts of a page needed to render it, which can be used without accessing the document.
+struct PageDisplay {
+  mupdf::FzDisplayList display_list;
+  Rect<float> bounds;
+};
+
+struct PrefetchConfig {
+  // The number of pages before and after the current page to prefetch.
+  int radius{3};
+  // The maximum number of pages to cache, which is at least the size of the prefetching window.
+  std::size_t capacity{16};
+  // Whether to load every page once after opening the document, in the background whenever there
+  // is nothing to prefetch, and to hand it out by `PageCache::take_warm` to be rendered once,
+  // which loads the fonts and decodes the images of the document into the store of MuPDF so that
+  // this does not happen while flipping pages. The pages themselves are not cached.
+  bool prewarm{false};
+};
+
+// A cache of the pages of a document, which loads the pages around the current page and builds
+// their display lists ahead of time on a background thread.
+// The least recently used pages are evicted once more than `capacity` pages are cached.
+// Whenever a page has been prefetched or a page to prewarm has been loaded, `on_prefetched` is
+// called on the main thread.
+// If prewarming is enabled, all pages are loaded once while there is nothing to prefetch, one at a
+// time, since each one is only loaded once the previous one has been taken by `take_warm`.
+//
+// MuPDF documents must not be used by multiple threads at once, so all accesses to the document
+// and its pages, including dropping them, happen while holding `doc_mutex_`. Pages only live
+// within `PdfPageInfo::load`, and the display lists do not refer to the document, so they can be
+// used on any thread, see `thread_contexts`.
+struct PageCache {
+  PageCache(mupdf::FzDocument doc, PrefetchConfig config, std::function<void()> on_prefetched)
+      : doc_{std::move(doc)}, page_count_{doc_.fz_count_pages()}, radius_{config.radius},
+        capacity_{std::max(config.capacity, std::size_t(2 * config.radius + 1))} {
+    warm_next_ = config.prewarm ? 0 : page_count_;
+    dispatcher_.connect(std::move(on_prefetched));
+    thread_ = std::jthread{[this](std::stop_token stoken) { run(stoken); }};
+  }
+  PageCache(const PageCache&) = delete;
+  PageCache(PageCache&&) = delete;
+  PageCache& operator=(const PageCache&) = delete;
+  PageCache& operator=(PageCache&&) = delete;
+  ~PageCache() = default;
+
+  // Store page `pno` in `slot`, loading it on the calling thread if it has not been prefetched,
+  // or reset `slot` if there is no such page.
+  // Prefetched pages are found without waiting for the document, which may be in use by the
+  // prefetching thread.
+  void assign(std::optional<PdfPageInfo>& slot, int pno) {
+    if (!valid_page(pno)) {
+      slot.reset();
+      return;
+    }
+    if (find_cached(slot, pno)) {
+      return;
+    }
+
+    std::scoped_lock doc_lock{doc_mutex_};
+    // The page may have been prefetched while waiting for the document.
+    if (find_cached(slot, pno)) {
+      return;
+    }
+    auto info = PdfPageInfo::load(doc_, pno);
+    std::scoped_lock lock{mutex_};
+    ++misses_;
+    slot.emplace(insert(pno, std::move(info)));
+  }
+
+  // Prefetch the pages within the prefetching radius around `pno`, nearest (and next) first.
+  void prefetch_around(int pno) {
+    {
+      std::scoped_lock lock{mutex_};
+      queue_.clear();
+      for (int d = 1; d <= radius_; ++d) {
+        for (const int p : {pno + d, pno - d}) {
+          if (!valid_page(p)) {
+            continue;
+          }
+          if (auto it = index_.find(p); it != index_.end()) {
+            // Keep the pages in the window from being evicted.
+            lru_.splice(lru_.begin(), lru_, it->second);
+          } else {
+            queue_.push_back(p);
+          }
+        }
+      }
+    }
+    cv_.notify_one();
+  }
+
+  // The next page to prewarm if it has been loaded, after which the following one is loaded.
+  [[nodiscard]] std::optional<std::pair<int, PageDisplay>> take_warm() {
+    std::optional<std::pair<int, PageDisplay>> page{};
+    {
+      std::scoped_lock lock{mutex_};
+      page.swap(warm_);
+    }
+    if (page.has_value()) {
+      if (page->first + 1 == page_count_) {
+        log("prewarming the last of {} pages\n", page_count_);
+      }
+      cv_.notify_one();
+    }
+    return page;
+  }
+
+  // The display list of page `pno` if it is cached, without loading it otherwise.
+  [[nodiscard]] std::optional<PageDisplay> find(int pno) {
+    std::scoped_lock lock{mutex_};
+    if (auto it = index_.find(pno); it != index_.end()) {
+      const PdfPageInfo& info = it->second->second;
+      return PageDisplay{.display_list = info.display_list, .bounds = info.bounds};
+    }
+    return std::nullopt;
+  }
+
+  [[nodiscard]] int page_count() const {
+    return page_count_;
+  }
+
+  [[nodiscard]] bool valid_page(int pno) const {
+    return 0 <= pno && pno < page_count_;
+  }
+
+private:
+  using Lru = std::list<std::pair<int, PdfPageInfo>>;
+
+  void run(std::stop_token stoken) {
+    while (true) {
+      int pno{};
+      bool warm = false;
+      {
+        std::unique_lock lock{mutex_};
+        if (!cv_.wait(lock, stoken, [&] {
+              return !queue_.empty() || (warm_next_ < page_count_ && !warm_.has_value());
+            })) {
+          return;
+        }
+        if (!queue_.empty()) {
+          pno = queue_.front();
+          queue_.pop_front();
+        } else {
+          pno = warm_next_++;
+          warm = true;
+        }
+      }
+
+      std::scoped_lock doc_lock{doc_mutex_};
+      try {
+        std::optional<PdfPageInfo> info{};
+        {
+          std::scoped_lock lock{mutex_};
+          if (auto it = index_.find(pno); it != index_.end()) {
+            if (!warm) {
+              continue;
+            }
+            info.emplace(it->second->second);
+          }
+        }
+        if (!info.has_value()) {
+          info.emplace(PdfPageInfo::load(doc_, pno));
+        }
+        {
+          std::scoped_lock lock{mutex_};
+          if (warm) {
+            warm_.emplace(pno, PageDisplay{.display_list = std::move(info->display_list),
+                                           .bounds = info->bounds});
+          } else {
+            insert(pno, std::move(*info));
+          }
+        }
+        dispatcher_.emit();
+      } catch (const std::exception& ex) {
+        fmt::print(stderr, "Prefetching page {} failed: {}\n", pno, ex.what());
+      }
+    }
+  }
+
+  // Store page `pno` in `slot` and mark it as the most recently used page if it is cached.
+  bool find_cached(std::optional<PdfPageInfo>& slot, int pno) {
+    std::scoped_lock lock{mutex_};
+    auto it = index_.find(pno);
+    if (it == index_.end()) {
+      return false;
+    }
+    ++hits_;
+    log("prefetched page {}; {} hits, {} misses, {} evictions\n", pno, hits_, misses_, evictions_);
+    lru_.splice(lru_.begin(), lru_, it->second);
+    slot.emplace(it->second->second);
+    return true;
+  }
+
+  // Insert `info` as the most recently used page and evict the least recently used pages
+  // beyond the capacity. Requires holding both `doc_mutex_` and `mutex_`.
+  const PdfPageInfo& insert(int pno, PdfPageInfo info) {
+    lru_.emplace_front(pno, std::move(info));
+    index_.emplace(pno, lru_.begin());
+    while (lru_.size() > capacity_) {
+      log("evict page {}\n", lru_.back().first);
+      ++evictions_;
+      index_.erase(lru_.back().first);
+      lru_.pop_back();
+    }
+    return lru_.front().second;
+  }
+
+  mupdf::FzDocument doc_;
+  int page_count_;
+  int radius_;
+  std::size_t capacity_;
+  Glib::Dispatcher dispatcher_{};
+  // Serializes all accesses to `doc_` and its pages.
+  std::mutex doc_mutex_{};
+  // Guards the members below.
+  std::mutex mutex_{};
+  std::condition_variable_any cv_{};
+  // The cached pages, most recently used first.
+  Lru lru_{};
+  std::unordered_map<int, Lru::iterator> index_{};
+  // The pages to prefetch, in order.
+  std::deque<int> queue_{};
+  // The next page to prewarm, or `page_count_` if there is none.
+  int warm_next_{0};
+  // The page to prewarm that has been loaded but not taken yet.
+  std::optional<std::pair<int, PageDisplay>> warm_{};
+  // The number of pages found in the cache, of those loaded on demand, and of evicted pages,
+  // which are logged whenever a page is opened.
+  std::size_t hits_{0};
+  std::size_t misses_{0};
+  std::size_t evictions_{0};
+  // Declared last so that the thread is stopped before the other members are destroyed.
+  std::jthread thread_{};
 };
 
 // Information about a PDF document and the page currently opened.
 struct PdfInfo {
   std::filesystem::path path;
-  mupdf::FzDocument doc;
+  PrefetchConfig prefetch;
+  // Called on the main thread whenever a page has been prefetched.
+  std::function<void()> on_prefetched;
   int page;
-  std::optional<PdfPageInfo> page_info;
+  std::optional<PdfPageInfo> page_info{};
+  // Declared after `page_info` so that the prefetching thread is stopped before it is destroyed.
+  std::optional<PageCache> pages{};
 
-  explicit PdfInfo(std::filesystem::path pdf, int pno = 0)
-      : path{std::move(pdf)}, doc{path.c_str()}, page{pno} {
-#if ILLUMINATA_PRINT
-    fmt::print("Open {:?}\n", path);
-#endif
+  explicit PdfInfo(std::filesystem::path pdf, int pno = 0, PrefetchConfig config = {},
+                   std::function<void()> prefetched = [] {})
+      : path{std::move(pdf)}, prefetch{config}, on_prefetched{std::move(prefetched)}, page{pno} {
+    log("Open {:?}\n", path);
+    pages.emplace(mupdf::FzDocument{path.c_str()}, prefetch, on_prefetched);
     update_page(pno);
   }
 
   void update_page(int pno) {
     page = pno;
-    if (valid_page(pno)) {
-#if ILLUMINATA_PRINT
-      fmt::print("load page {}\n", pno);
-#endif
-      mupdf::FzPage p = doc.fz_load_page(pno);
-      page_info = PdfPageInfo(p, p.fz_new_display_list_from_page());
+    pages->assign(page_info, pno);
+    if (page_info.has_value()) {
+      pages->prefetch_around(pno);
     } else {
-#if ILLUMINATA_PRINT
-      fmt::print("reset page info\n");
-#endif
-      page_info.reset();
+      log("reset page info\n");
     }
   }
 
   void reload_doc() {
-    doc = mupdf::FzDocument{path.c_str()};
-    update_page(std::max(std::min(page, doc.fz_count_pages() - 1), 0));
+    pages.reset();
+    page_info.reset();
+    pages.emplace(mupdf::FzDocument{path.c_str()}, prefetch, on_prefetched);
+    update_page(std::max(std::min(page, pages->page_count() - 1), 0));
   }
 
   [[nodiscard]] bool valid_page(int pno) const {
-    return 0 <= pno && pno < doc.fz_count_pages();
+    return pages->valid_page(pno);
   }
 };
 } // namespace illa
@@ -3,156 +3,333 @@
 
 #include <array>
 #include <cmath>
+#include <cstddef>
 #include <optional>
+#include <vector>
 
 #include "illuminata/geometry.hpp"
 #include "illuminata/mupdf.hpp"
 #include "illuminata/opengl.hpp"
+#include "illuminata/pdf/atlas.hpp"
+#include "illuminata/pdf/render.hpp"
+#include "illuminata/pdf/staging.hpp"
+#include "illuminata/pdf/upload.hpp"
+#include "illuminata/pdf/worker.hpp"
 
 #if ILLUMINATA_PRINT
 #include "illuminata/fmt.hpp"
 #endif
 
 namespace illa {
-// A screen-filling quad used so that the fragment shader is called for every pixel.
-inline constexpr std::array<GLfloat, 12> vertex_data{
-  -1.F, +1.F, // vertex 0
-  +1.F, -1.F, // vertex 1
-  -1.F, -1.F, // vertex 2
-  -1.F, +1.F, // vertex 3
-  +1.F, +1.F, // vertex 4
-  +1.F, -1.F, // vertex 5
+// A unit square as a triangle strip, which is mapped onto each tile part drawn.
+inline constexpr std::array<GLfloat, 8> vertex_data{
+  0.F, 0.F, // vertex 0
+  1.F, 0.F, // vertex 1
+  0.F, 1.F, // vertex 2
+  1.F, 1.F, // vertex 3
 };
 
-// Passing through the vertex coordinates of a screen-filling quad.
-inline constexpr char vertex_shader_code[] = "#version 320 es\n"
-                                             "\n"
-                                             "layout(location = 0) in vec2 position;\n"
-                                             "\n"
-                                             "void main() {\n"
-                                             "  gl_Position = vec4(position, 0.0, 1.0);\n"
-                                             "}";
-
-// If the coordinate is in the visible area, fetch the correct texel and optionally inverts it,
-// otherwise returns a fully transparent color.
-inline constexpr char fragment_shader_code[] =
-  "#version 320 es\n"
-  "precision mediump float;\n"
+// The header shared by both shaders. `highp` is needed for exact coordinates on large screens.
+inline constexpr char shader_header_code[] = "#version 320 es\n"
+                                             "precision highp float;\n"
+                                             "precision highp sampler2DArray;\n"
+                                             "\n";
+
+// The uniform block describing the placement of the frame in the view, shared by both shaders.
+// `offset` is the position of the upper left corner of the frame in the view (in pixels),
+// and `layerDims` are the dimensions of the layers of the texture, i.e. of the tiles in the atlas.
+inline constexpr char view_block_code[] = "layout(std140) uniform View {\n"
+                                          "  vec2 viewDims;\n"
+                                          "  vec2 offset;\n"
+                                          "  vec2 layerDims;\n"
+                                          "  float scale;\n"
+                                          "};\n"
+                                          "\n";
+
+// The uniform block `View` as laid out by std140.
+struct ViewBlock {
+  std::array<GLfloat, 2> view_dims;
+  std::array<GLfloat, 2> offset;
+  std::array<GLfloat, 2> layer_dims;
+  GLfloat scale;
+  GLfloat padding;
+};
+static_assert(sizeof(ViewBlock) == 32);
+
+// The per-instance attributes of a tile part: The part `rect` of the frame and the origin of its
+// tile (both in frame coordinates, relative to the upper left corner of the frame, so that they
+// remain exact at any zoom level), and the layer of the atlas holding the tile.
+struct TileInstance {
+  std::array<GLfloat, 4> rect;
+  std::array<GLfloat, 2> origin;
+  GLfloat layer;
+};
+static_assert(sizeof(TileInstance) == 7 * sizeof(GLfloat));
+
+// Maps the unit square onto the part of the tile of the instance, scaled and placed in the view,
+// and passes on the frame coordinates. Since gl_Position.y increases from bottom to top,
+// the view coordinates are flipped.
+// Preceded by `shader_header_code` and `view_block_code`.
+inline constexpr char vertex_shader_code[] =
+  "layout(location = 0) in vec2 position;\n"
+  "layout(location = 1) in vec4 rect;\n"
+  "layout(location = 2) in vec2 origin;\n"
+  "layout(location = 3) in float layer;\n"
+  "out vec2 coord;\n"
+  "flat out vec4 partRect;\n"
+  "flat out vec3 tileOrigin;\n"
   "\n"
+  "void main() {\n"
+  "  coord = mix(rect.xy, rect.zw, position);\n"
+  "  partRect = rect;\n"
+  "  tileOrigin = vec3(origin, layer);\n"
+  "  vec2 p = (offset + coord * scale) / viewDims;\n"
+  "  gl_Position = vec4(2.0 * p.x - 1.0, 1.0 - 2.0 * p.y, 0.0, 1.0);\n"
+  "}";
+
+// Sample the layer of the tile at the frame coordinate with linear (or, for the page texture,
+// trilinear) filtering and optionally invert the color. For unscaled frames placed on the pixel
+// grid, the pixel centres hit the texel centres exactly, so that the frame is shown texel by texel.
+// Preceded by `shader_header_code` and `view_block_code`.
+inline constexpr char fragment_shader_code[] =
+  "in vec2 coord;\n"
+  "flat in vec4 partRect;\n"
+  "flat in vec3 tileOrigin;\n"
   "out vec4 outColor;\n"
-  // {offset.x, windowDims.y - offset.y}
-  "uniform int offsets[2];\n"
   "uniform bool invert;\n"
-  "uniform sampler2D tex;\n"
+  "uniform sampler2DArray tex;\n"
   "\n"
   "void main() {\n"
-  "  ivec2 coord = ivec2(gl_FragCoord);\n"
-  // The coordinate within tex, where the “offset” from above is relative to the upper left corner.
-  // Since gl_FragCoord.y increases from bottom to top, coord.y is
-  // (windowDims.y - 1 - coord.y) - offset.y
-  "  coord = ivec2(coord.x - offsets[0], offsets[1] - coord.y - 1);\n"
-  "  ivec2 texDims = textureSize(tex, 0);\n"
-  "  if (0 > coord.x || coord.x >= texDims.x || 0 > coord.y || coord.y >= texDims.y) {\n"
-  "    outColor = vec4(0.0);\n"
-  "  } else {\n"
-  "    outColor = texelFetch(tex, coord, 0);\n"
-  //   For the inversion, convert the sRGB color to YCbCR, invert Y, and convert back.
-  //   Intuitively, this preserves hue and saturation (reasonably well) while inverting brightness.
-  "    if (invert) {\n"
-  "      const float h = 128.0 / 255.0;\n"
-  "      float y  = 0.299 * outColor.r + 0.587 * outColor.g + 0.114 * outColor.b;\n"
-  "      float cb = h - 0.168736 * outColor.r - 0.331264 * outColor.g + 0.5 * outColor.b;\n"
-  "      float cr = h + 0.5 * outColor.r - 0.418688 * outColor.g - 0.081312 * outColor.b;\n"
-  "      y = 1.0 - y;\n"
-  "      float r = y + 1.402 * (cr - h);\n"
-  "      float g = y - 0.344136 * (cb - h) - 0.714136 * (cr - h);\n"
-  "      float b = y + 1.772 * (cb - h);\n"
-  "      outColor = vec4(r, g, b, outColor.a);\n"
-  "    }\n"
+  // Clamped so that only uploaded texels are sampled. Hence, there is no filtering across the
+  // edges of tiles, which is only noticeable in the half pixel along them when scaling.
+  "  vec2 c = clamp(coord, partRect.xy + 0.5, partRect.zw - 0.5);\n"
+  "  outColor = texture(tex, vec3((c - tileOrigin.xy) / layerDims, tileOrigin.z));\n"
+  // For the inversion, convert the sRGB color to YCbCR, invert Y, and convert back.
+  // Intuitively, this preserves hue and saturation (reasonably well) while inverting brightness.
+  "  if (invert) {\n"
+  "    const float h = 128.0 / 255.0;\n"
+  "    float y  = 0.299 * outColor.r + 0.587 * outColor.g + 0.114 * outColor.b;\n"
+  "    float cb = h - 0.168736 * outColor.r - 0.331264 * outColor.g + 0.5 * outColor.b;\n"
+  "    float cr = h + 0.5 * outColor.r - 0.418688 * outColor.g - 0.081312 * outColor.b;\n"
+  "    y = 1.0 - y;\n"
+  "    float r = y + 1.402 * (cr - h);\n"
+  "    float g = y - 0.344136 * (cb - h) - 0.714136 * (cr - h);\n"
+  "    float b = y + 1.772 * (cb - h);\n"
+  "    outColor = vec4(r, g, b, outColor.a);\n"
   "  }\n"
   "}";
 
+// The OpenGL state of the view, which shows frames from a texture atlas of tiles.
+// Frames are uploaded tile by tile into the layers of a 2D array texture by `uploader`, usually on
+// the render worker thread, and are drawn as one instance of a quad per visible tile part in a
+// single draw call.
 struct OpenGlState {
+  // The uniform buffer binding point of the uniform block `View`.
+  static constexpr GLuint view_binding = 0;
+
+  explicit OpenGlState(std::size_t texture_budget = FrameUploader::default_texture_budget,
+                       std::size_t staging_budget = FrameUploader::default_staging_budget)
+      : uploader{texture_budget, staging_budget} {}
+  OpenGlState(const OpenGlState&) = delete;
+  OpenGlState(OpenGlState&&) = delete;
+  OpenGlState& operator=(const OpenGlState&) = delete;
+  OpenGlState& operator=(OpenGlState&&) = delete;
+  ~OpenGlState() = default;
+
   // An optional so that it can be created in `realize` and destroyed in `unrealize`.
   std::optional<gl::Program> prog{};
   // An optional so that it can be created in `realize` and destroyed in `unrealize`.
   std::optional<gl::VertexArray> vtxs{};
-  // An optional so that it can be created in `realize` and destroyed in `unrealize`.
-  std::optional<gl::Texture> tex{};
+  // The vertices of the unit square (created in `realize` and destroyed in `unrealize`).
+  std::optional<gl::Buffer> quad{};
+  // The `TileInstance`s of the tile parts to draw, refilled on every draw
+  // (created in `realize` and destroyed in `unrealize`).
+  std::optional<gl::Buffer> instances{};
+  // The buffer backing the uniform block `View`
+  // (created in `realize` and destroyed in `unrealize`).
+  std::optional<gl::Buffer> view_ubo{};
+  // Uploads the frames, which may also be called from other threads with a shared context.
+  FrameUploader uploader;
   GLint invert_uniform{};
-  GLint offs_uniform{};
   GLint tex_uniform{};
 
-  // Called to initialize the GLArea.
-  void realize() {
+  // Called to initialize the GLArea, where frames can be rendered into buffers provided to `pool`.
+  void realize(StagingPool& pool) {
     gl::VertexArray& vao = vtxs.emplace();
 
-    // Set the vertex array buffer to a screen-filling quad.
+    // Set up the vertex array to draw instances of the unit square, with one instance per tile
+    // part, whose attributes are recorded in the vertex array.
     {
-      GLuint buffer{};
-      glGenBuffers(1, &buffer);
-
       auto vao_ctx = vao.bind();
-      glBindBuffer(GL_ARRAY_BUFFER, buffer);
-      glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_data), vertex_data.data(), GL_STATIC_DRAW);
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+      gl::Buffer& vbo = quad.emplace(gl::BufferBindingTarget::array_buffer);
+      auto vbo_ctx = vbo.bind();
+      vbo.data(vertex_data.data(), sizeof(vertex_data), GL_STATIC_DRAW);
+      glEnableVertexAttribArray(0);
+      glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+      gl::Buffer& ibo = instances.emplace(gl::BufferBindingTarget::array_buffer);
+      auto ibo_ctx = ibo.bind();
+      const auto attrib = [](GLuint index, GLint size, std::size_t offset) {
+        glEnableVertexAttribArray(index);
+        glVertexAttribPointer(index, size, GL_FLOAT, GL_FALSE, sizeof(TileInstance),
+                              reinterpret_cast<const void*>(offset));
+        glVertexAttribDivisor(index, 1);
+      };
+      attrib(1, 4, offsetof(TileInstance, rect));
+      attrib(2, 2, offsetof(TileInstance, origin));
+      attrib(3, 1, offsetof(TileInstance, layer));
     }
 
-    gl::Shader vertex{gl::ShaderKind::vertex_shader, vertex_shader_code};
-    gl::Shader fragment{gl::ShaderKind::fragment_shader, fragment_shader_code};
+    gl::Shader vertex{gl::ShaderKind::vertex_shader,
+                      {shader_header_code, view_block_code, vertex_shader_code}};
+    gl::Shader fragment{gl::ShaderKind::fragment_shader,
+                        {shader_header_code, view_block_code, fragment_shader_code}};
 
     gl::Program& program = prog.emplace();
     program.attach(vertex);
     program.attach(fragment);
     program.link();
     invert_uniform = program.uniform_location("invert");
-    offs_uniform = program.uniform_location("offsets");
     tex_uniform = program.uniform_location("tex");
+    program.bind_uniform_block("View", view_binding);
+    view_ubo.emplace(gl::BufferBindingTarget::uniform_buffer);
     program.detach(vertex);
     program.detach(fragment);
 
-    tex.emplace(gl::TextureKind::texture_2d);
+    uploader.realize(pool);
   }
 
+  // Requires that no frames rendered into staging buffers or uploaded are used anymore
+  // and that no other thread uploads frames.
   void unrealize() {
+    uploader.unrealize();
+    view_ubo.reset();
+    instances.reset();
+    quad.reset();
     vtxs.reset();
     prog.reset();
   }
 
-  void draw(mupdf::FzPixmap& pix, const Dims<int> dims, const Vec2<float> off, bool invert) {
+  // Clear the view to the background color.
+  void clear() {
+    collect();
     glClearColor(0.5, 0.5, 0.5, 1.0);
     glClear(GL_COLOR_BUFFER_BIT);
+  }
 
-    {
-      auto prog_ctx = prog.value().use();
-      auto& vao = vtxs.value();
-      auto vao_ctx = vao.bind();
-      auto buf_ctx = vao.bind_buffer(gl::BufferBindingTarget::array_buffer);
-
-      {
-        gl::TextureUnit tu{0};
-        auto& tx = *tex;
-        tu.bind(tx);
+  // Draw `frame` at offset `off`, scaled by `scale`, uploading it first unless this has been done
+  // already, usually by the render worker. Only the visible tile parts are drawn, in one instanced
+  // draw call, while the rest of the view is transparent.
+  void draw(Frame& frame, const Dims<int> dims, Vec2<float> off, float scale, bool invert) {
+    collect();
+    if (frame.upload == nullptr) {
 #if ILLUMINATA_PRINT
-        fmt::print("load: {}×{}×{}\n", pix.w(), pix.h(), pix.s());
+      fmt::print("load: {}×{}×{}\n", frame.pix.w(), frame.pix.h(), frame.pix.s());
 #endif
-        tx.load(pix.samples(), pix.w(), pix.h(), gl::PixelFormat::rgb);
-        tu.set_uniform(tex_uniform);
-      }
+      frame.upload = uploader.upload(frame, true);
+    }
+    if (frame.upload == nullptr) {
+      // The texture budget leaves no room for the atlas, so the view stays transparent.
+      glClearColor(0.0, 0.0, 0.0, 0.0);
+      glClear(GL_COLOR_BUFFER_BIT);
+      return;
+    }
+    const FrameUpload& up = *frame.upload;
 
-      {
-        glUniform1i(invert_uniform, static_cast<GLint>(invert));
-        std::array<GLint, 2> arr{GLint(std::round(off.x)), GLint(dims.h - std::lround(off.y))};
-        glUniform1iv(offs_uniform, arr.size(), arr.data());
+    // Unscaled frames are aligned to the pixel grid to keep them sharp.
+    if (scale == 1.F) {
+      off = Vec2{std::round(off.x), std::round(off.y)};
+    }
+    // The visible part of the frame (pixel coordinates).
+    const mupdf::FzIrect box = frame.geom.irect;
+    const mupdf::FzIrect visible = intersect(
+      box, mupdf::FzIrect{box.x0 + int(std::floor(-off.x / scale)),
+                          box.y0 + int(std::floor(-off.y / scale)),
+                          box.x0 + int(std::ceil((float(dims.w) - off.x) / scale)),
+                          box.y0 + int(std::ceil((float(dims.h) - off.y) / scale))});
+    std::vector<TileInstance> insts{};
+    for (const AtlasPart& part : up.parts) {
+      const mupdf::FzIrect r = intersect(part.rect, visible);
+      if (is_empty(r)) {
+        continue;
       }
+      insts.push_back(TileInstance{
+        .rect = {float(r.x0 - box.x0), float(r.y0 - box.y0), float(r.x1 - box.x0),
+                 float(r.y1 - box.y0)},
+        .origin = {float(r.x0 - floor_mod(r.x0, atlas_tile_size) - box.x0),
+                   float(r.y0 - floor_mod(r.y0, atlas_tile_size) - box.y0)},
+        .layer = float(part.layer),
+      });
+    }
+    draw_instances(*up.texture, *up.fence, insts, dims, off, scale, invert);
+  }
 
-      glEnableVertexAttribArray(0);
-      glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
-      glDrawArrays(GL_TRIANGLES, 0, vertex_data.size());
-      glDisableVertexAttribArray(0);
+  // Draw the page texture `page` at offset `off`, scaled by `scale`.
+  void draw_page(const PageTexture& page, const Dims<int> dims, Vec2<float> off, float scale,
+                 bool invert) {
+    collect();
+    if (scale == 1.F) {
+      off = Vec2{std::round(off.x), std::round(off.y)};
+    }
+    const auto w = float(page.tex->width());
+    const auto h = float(page.tex->height());
+    const std::vector<TileInstance> insts{
+      TileInstance{.rect = {0.F, 0.F, w, h}, .origin = {0.F, 0.F}, .layer = 0.F},
+    };
+    draw_instances(*page.tex, page.fence, insts, dims, off, scale, invert);
+  }
+
+  // Delete the objects released by the uploader and allow the textures released so far to be
+  // reused once the draws issued before are done, which is only sound in this context, since the
+  // frames are drawn in it.
+  void collect() {
+    uploader.collect();
+    uploader.fence_released();
+  }
+
+  // Draw the tile parts `insts` of the layers of `texture`, which has been uploaded before
+  // `fence`, in one instanced draw call.
+  void draw_instances(const gl::Texture& texture, const gl::Fence& fence,
+                      const std::vector<TileInstance>& insts, const Dims<int> dims,
+                      Vec2<float> off, float scale, bool invert) {
+    glClearColor(0.0, 0.0, 0.0, 0.0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    if (insts.empty()) {
+      return;
+    }
+    // Only waits on the GPU, which is usually done with an upload by the render worker by now.
+    fence.gpu_wait();
+
+    auto prog_ctx = prog.value().use();
+    {
+      gl::TextureUnit tu{0};
+      tu.bind(texture);
+      tu.set_uniform(tex_uniform);
+    }
+    {
+      auto ibo_ctx = instances->bind();
+      instances->data(insts.data(), GLsizeiptr(insts.size() * sizeof(TileInstance)),
+                      GL_STREAM_DRAW);
+    }
+
+    glUniform1i(invert_uniform, static_cast<GLint>(invert));
+    const ViewBlock block{
+      .view_dims = {float(dims.w), float(dims.h)},
+      .offset = {off.x, off.y},
+      .layer_dims = {float(texture.width()), float(texture.height())},
+      .scale = scale,
+      .padding = 0.F,
+    };
+    {
+      auto ubo_ctx = view_ubo->bind();
+      view_ubo->data(&block, sizeof(block), GL_STREAM_DRAW);
     }
+    view_ubo->bind_base(view_binding);
 
-    glFlush();
+    auto vao_ctx = vtxs.value().bind();
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, vertex_data.size() / 2, GLsizei(insts.size()));
+    // No flush is needed: The GLArea flushes when presenting and the uploads are guarded by fences.
   }
 };
 } // namespace illa
@@ -0,0 +1,208 @@
+#ifndef INCLUDE_ILLUMINATA_PDF_PIXMAPS_HPP
+#define INCLUDE_ILLUMINATA_PDF_PIXMAPS_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "illuminata/mupdf.hpp"
+#include "illuminata/pdf/render.hpp"
+
+namespace illa {
+// A frame pixmap whose samples are held by a buffer of a `PixmapPool`.
+struct PooledPixmap {
+  // Declared before `pix` so that the buffer is returned after the pixmap is dropped.
+  std::shared_ptr<unsigned char[]> samples;
+  mupdf::FzPixmap pix;
+};
+
+// The allocations of a `PixmapPool`.
+struct PixmapStats {
+  // The number of allocations made by the pool, i.e. of the buffers requested while no returned
+  // buffer fit, of the reference counts of the buffers handed out while none could be recycled,
+  // and of the growths of the list of returned buffers.
+  std::size_t allocations;
+  // The number of returned buffers handed out again.
+  std::size_t reuses;
+  // The memory occupied by the returned buffers (in bytes).
+  std::size_t cached;
+};
+
+// Sample buffers for frame pixmaps, which are recycled instead of allocating (and paging in)
+// a new buffer for every frame or tile. Buffers are handed out as shared pointers and returned
+// to the pool once the last reference is dropped, which requires that the pixmap wrapping them
+// has been dropped before. A returned buffer is handed out again for pixmaps that need at least
+// half of it, and the least recently returned buffers are freed once the returned buffers occupy
+// more than the budget. The reference counts of the buffers handed out and the list of returned
+// buffers are recycled as well, so that handing out and returning buffers does not allocate
+// once the pool has warmed up, except when evicting buffers. All member functions may be called
+// from any thread.
+struct PixmapPool {
+  // The default memory budget of the returned buffers (in bytes).
+  static constexpr std::size_t default_budget = std::size_t{128} << 20U;
+
+  explicit PixmapPool(std::size_t budget = default_budget) {
+    shared_->budget = budget;
+  }
+  PixmapPool(const PixmapPool&) = delete;
+  PixmapPool(PixmapPool&&) = delete;
+  PixmapPool& operator=(const PixmapPool&) = delete;
+  PixmapPool& operator=(PixmapPool&&) = delete;
+  ~PixmapPool() = default;
+
+  // A buffer of at least `size` bytes, which is the smallest fitting returned buffer if there is
+  // one. Its contents are unspecified.
+  [[nodiscard]] std::shared_ptr<unsigned char[]> acquire(std::size_t size) {
+    std::unique_ptr<unsigned char[]> data{};
+    std::size_t capacity = size;
+    {
+      std::scoped_lock lock{shared_->mutex};
+      auto& free = shared_->free;
+      auto best = free.end();
+      for (auto it = free.begin(); it != free.end(); ++it) {
+        if (size <= it->size && it->size / 2 <= size &&
+            (best == free.end() || it->size < best->size)) {
+          best = it;
+        }
+      }
+      if (best != free.end()) {
+        data = std::move(best->data);
+        capacity = best->size;
+        shared_->cached -= capacity;
+        free.erase(best);
+        ++shared_->reuses;
+      } else {
+        ++shared_->allocations;
+      }
+    }
+    if (data == nullptr) {
+      data = std::make_unique_for_overwrite<unsigned char[]>(size);
+    }
+    return std::shared_ptr<unsigned char[]>(
+      data.release(),
+      [shared = shared_, capacity](unsigned char* ptr) {
+        std::unique_ptr<unsigned char[]> returned{ptr};
+        std::vector<std::unique_ptr<unsigned char[]>> evicted{};
+        std::scoped_lock lock{shared->mutex};
+        auto& free = shared->free;
+        if (free.size() == free.capacity()) {
+          ++shared->allocations;
+        }
+        free.push_back(Free{.data = std::move(returned), .size = capacity});
+        shared->cached += capacity;
+        std::size_t count = 0;
+        while (shared->cached > shared->budget) {
+          shared->cached -= free[count].size;
+          // Freed after releasing the mutex.
+          evicted.push_back(std::move(free[count].data));
+          ++count;
+        }
+        free.erase(free.begin(), free.begin() + std::ptrdiff_t(count));
+      },
+      BlockAllocator<unsigned char>{shared_});
+  }
+
+  // A pixmap in the format of frames covering `rect`, whose samples are held by a buffer of the
+  // pool. Its samples are unspecified.
+  [[nodiscard]] PooledPixmap new_pixmap(const mupdf::FzIrect& rect) {
+    std::shared_ptr<unsigned char[]> samples = acquire(frame_bytes(rect));
+    mupdf::FzPixmap pix = new_frame_pixmap(rect, samples.get());
+    return {.samples = std::move(samples), .pix = std::move(pix)};
+  }
+
+  [[nodiscard]] PixmapStats stats() const {
+    std::scoped_lock lock{shared_->mutex};
+    return {
+      .allocations = shared_->allocations,
+      .reuses = shared_->reuses,
+      .cached = shared_->cached,
+    };
+  }
+
+private:
+  struct Shared;
+
+  // A returned buffer.
+  struct Free {
+    std::unique_ptr<unsigned char[]> data;
+    std::size_t size;
+  };
+
+  // A block that held a reference count, linked into the list of blocks to recycle.
+  struct Block {
+    Block* next;
+  };
+
+  // Allocates the reference counts of the buffers handed out, which all have the same size,
+  // from the blocks of earlier ones.
+  template<typename T>
+  struct BlockAllocator {
+    using value_type = T;
+
+    explicit BlockAllocator(std::shared_ptr<Shared> s) : shared{std::move(s)} {}
+    // Implicit, as required to rebind allocators.
+    template<typename U>
+    BlockAllocator(const BlockAllocator<U>& other) : shared{other.shared} {} // NOLINT
+
+    T* allocate(std::size_t n) {
+      static_assert(sizeof(T) >= sizeof(Block) && alignof(T) >= alignof(Block) &&
+                    alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+      if (n == 1) {
+        std::scoped_lock lock{shared->mutex};
+        if (Block* block = shared->blocks; block != nullptr) {
+          shared->blocks = block->next;
+          return reinterpret_cast<T*>(block);
+        }
+        ++shared->allocations;
+      }
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* ptr, std::size_t n) {
+      if (n == 1) {
+        std::scoped_lock lock{shared->mutex};
+        shared->blocks = new (ptr) Block{.next = shared->blocks};
+        return;
+      }
+      ::operator delete(ptr);
+    }
+
+    template<typename U>
+    bool operator==(const BlockAllocator<U>& other) const {
+      return shared == other.shared;
+    }
+
+    std::shared_ptr<Shared> shared;
+  };
+
+  // Shared with the buffers handed out, which may be returned after the pool is gone.
+  struct Shared {
+    std::mutex mutex{};
+    std::size_t budget{};
+    std::size_t allocations{0};
+    std::size_t reuses{0};
+    std::size_t cached{0};
+    // The returned buffers, least recently returned first.
+    std::vector<Free> free{};
+    // The blocks of the reference counts of the buffers returned, which are recycled.
+    Block* blocks{};
+
+    Shared() = default;
+    Shared(const Shared&) = delete;
+    Shared(Shared&&) = delete;
+    Shared& operator=(const Shared&) = delete;
+    Shared& operator=(Shared&&) = delete;
+    ~Shared() {
+      while (blocks != nullptr) {
+        ::operator delete(std::exchange(blocks, blocks->next));
+      }
+    }
+  };
+
+  std::shared_ptr<Shared> shared_{std::make_shared<Shared>()};
+};
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_PDF_PIXMAPS_HPP
@@ -0,0 +1,219 @@
+#ifndef INCLUDE_ILLUMINATA_PDF_RENDER_HPP
+#define INCLUDE_ILLUMINATA_PDF_RENDER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "illuminata/geometry.hpp"
+#include "illuminata/mupdf.hpp"
+#include "illuminata/threads.hpp"
+
+namespace illa {
+// Division rounding towards negative infinity, since pixel coordinates can be negative.
+inline constexpr int floor_div(int a, int b) {
+  return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+// The remainder of `floor_div`, which is in [0, b).
+inline constexpr int floor_mod(int a, int b) {
+  return a - floor_div(a, b) * b;
+}
+
+inline bool is_empty(const mupdf::FzIrect& r) {
+  return r.x0 >= r.x1 || r.y0 >= r.y1;
+}
+
+inline mupdf::FzIrect intersect(const mupdf::FzIrect& a, const mupdf::FzIrect& b) {
+  mupdf::FzIrect r{};
+  r.x0 = std::max(a.x0, b.x0);
+  r.y0 = std::max(a.y0, b.y0);
+  r.x1 = std::max(std::min(a.x1, b.x1), r.x0);
+  r.y1 = std::max(std::min(a.y1, b.y1), r.y0);
+  return r;
+}
+
+// The parts of `a` not covered by `b` as up to four disjoint rectangles.
+inline std::vector<mupdf::FzIrect> subtract(const mupdf::FzIrect& a, const mupdf::FzIrect& b) {
+  const mupdf::FzIrect i = intersect(a, b);
+  if (is_empty(i)) {
+    return is_empty(a) ? std::vector<mupdf::FzIrect>{} : std::vector{a};
+  }
+  std::vector<mupdf::FzIrect> out{};
+  // The parts above and below `b` over the full width, and those left and right of it in between.
+  for (const mupdf::FzIrect r : {mupdf::FzIrect{a.x0, a.y0, a.x1, i.y0},
+                                 mupdf::FzIrect{a.x0, i.y1, a.x1, a.y1},
+                                 mupdf::FzIrect{a.x0, i.y0, i.x0, i.y1},
+                                 mupdf::FzIrect{i.x1, i.y0, a.x1, i.y1}}) {
+    if (!is_empty(r)) {
+      out.push_back(r);
+    }
+  }
+  return out;
+}
+
+// The number of zoom levels per doubling of the scaling factor.
+// Scaling factors are quantized to these levels so that tiles rendered at a zoom level can be
+// reused when returning to it. The quantization changes the size of the page by less than 0.04%.
+inline constexpr int zoom_levels_per_octave = 1024;
+inline int zoom_level(float factor) {
+  return int(std::lround(std::log2(factor) * float(zoom_levels_per_octave)));
+}
+inline float quantize_factor(float factor) {
+  return std::exp2(float(zoom_level(factor)) / float(zoom_levels_per_octave));
+}
+
+// The geometry of the view of a page, as computed by `PdfViewer::compute_geom`.
+struct GeomInfo {
+  Dims<int> dims_base;
+  Dims<int> dims_scaled;
+  int scale;
+  float factor;
+  mupdf::FzMatrix fzmat;
+  Vec2<float> offset;
+  mupdf::FzRect rclip;
+  mupdf::FzIrect irect;
+  // The page bounds (document coordinates).
+  mupdf::FzRect bounds;
+
+  // The page bounds (pixel coordinates).
+  [[nodiscard]] mupdf::FzIrect page_irect() const {
+    return mupdf::FzRect{bounds}.fz_transform_rect(fzmat).fz_round_rect();
+  }
+
+  // Whether the pixmap rendered with this geometry contains the pixmap rendered with `other`.
+  [[nodiscard]] bool covers(const GeomInfo& other) const {
+    return factor == other.factor && irect.x0 <= other.irect.x0 && irect.y0 <= other.irect.y0 &&
+           other.irect.x1 <= irect.x1 && other.irect.y1 <= irect.y1;
+  }
+
+  // This geometry with the rendered area extended by `margin` pixels on each side,
+  // as far as the page extends.
+  [[nodiscard]] GeomInfo with_overscan(int margin) const {
+    const mupdf::FzIrect page = page_irect();
+    GeomInfo geom = *this;
+    geom.irect.x0 = std::min(irect.x0, std::max(irect.x0 - margin, page.x0));
+    geom.irect.y0 = std::min(irect.y0, std::max(irect.y0 - margin, page.y0));
+    geom.irect.x1 = std::max(irect.x1, std::min(irect.x1 + margin, page.x1));
+    geom.irect.y1 = std::max(irect.y1, std::min(irect.y1 + margin, page.y1));
+    geom.rclip = mupdf::FzRect{float(geom.irect.x0) / factor, float(geom.irect.y0) / factor,
+                               float(geom.irect.x1) / factor, float(geom.irect.y1) / factor};
+    geom.offset =
+      offset + Vec2{float(geom.irect.x0 - irect.x0), float(geom.irect.y0 - irect.y0)};
+    return geom;
+  }
+
+  // Whether rendering with `other` results in the same pixmap as rendering with this geometry,
+  // i.e. only the placement of the pixmap in the view may differ.
+  [[nodiscard]] bool same_raster(const GeomInfo& other) const {
+    return factor == other.factor && rclip.x0 == other.rclip.x0 && rclip.x1 == other.rclip.x1 &&
+           rclip.y0 == other.rclip.y0 && rclip.y1 == other.rclip.y1 &&
+           irect.x0 == other.irect.x0 && irect.x1 == other.irect.x1 &&
+           irect.y0 == other.irect.y0 && irect.y1 == other.irect.y1;
+  }
+};
+
+// The cookie of a render that is split into parts rendered in parallel, with one MuPDF cookie per
+// part, since MuPDF cookies must not be shared between threads.
+// All member functions may be called from any thread.
+struct RenderCookie {
+  // Abort all parts, including those whose cookies are created later on.
+  void abort() {
+    std::scoped_lock lock{mutex_};
+    aborted_ = true;
+    for (mupdf::FzCookie& cookie : parts_) {
+      cookie.set_abort();
+    }
+  }
+  [[nodiscard]] bool aborted() {
+    std::scoped_lock lock{mutex_};
+    return aborted_;
+  }
+
+  // The cookie for part `i`, which remains valid for the lifetime of this object.
+  mupdf::FzCookie& part(std::size_t i) {
+    std::scoped_lock lock{mutex_};
+    while (parts_.size() <= i) {
+      mupdf::FzCookie& cookie = parts_.emplace_back();
+      if (aborted_) {
+        cookie.set_abort();
+      }
+    }
+    return parts_[i];
+  }
+
+private:
+  std::mutex mutex_{};
+  bool aborted_{false};
+  // A deque so that references to the cookies remain valid when adding parts.
+  std::deque<mupdf::FzCookie> parts_{};
+};
+
+// Frames are rendered as BGRA with four bytes per pixel, which is uploaded to textures without
+// conversion and which is the memory layout of Cairo's ARGB32 (on little-endian machines).
+// Since the background is opaque white, the alpha channel is always opaque.
+inline constexpr std::size_t frame_components = 4;
+
+// The number of bytes of a frame covering `rect`.
+inline std::size_t frame_bytes(const mupdf::FzIrect& rect) {
+  return std::size_t(rect.x1 - rect.x0) * std::size_t(rect.y1 - rect.y0) * frame_components;
+}
+
+// A pixmap for a frame covering `rect`, which uses `samples` (of at least `frame_bytes(rect)`
+// bytes) if given, and allocates its own samples otherwise.
+inline mupdf::FzPixmap new_frame_pixmap(const mupdf::FzIrect& rect,
+                                        unsigned char* samples = nullptr) {
+  if (samples != nullptr) {
+    return mupdf::fz_new_pixmap_with_bbox_and_data(mupdf::FzColorspace::Fixed_BGR, rect,
+                                                   mupdf::FzSeparations{}, 1, samples);
+  }
+  return mupdf::FzPixmap{mupdf::FzColorspace::Fixed_BGR, rect, mupdf::FzSeparations{}, 1};
+}
+
+// The minimum height of a band (in pixels), below which splitting is not worth it.
+inline constexpr int min_band_height = 64;
+
+// Rasterize the part of `list` covered by `pix` onto a white background,
+// where `mat` maps document to pixel coordinates by scaling with `factor`.
+// Only the display list items intersecting `clip` (document coordinates) are run.
+inline void render_into(mupdf::FzDisplayList& list, const mupdf::FzMatrix& mat, float factor,
+                        Rect<float> clip, mupdf::FzPixmap& pix, mupdf::FzCookie& cookie) {
+  const mupdf::FzIrect bbox = pix.fz_pixmap_bbox();
+  const Rect<float> bbox_doc =
+    Rect<float>{float(bbox.x0), float(bbox.x1), float(bbox.y0), float(bbox.y1)} / factor;
+
+  pix.fz_clear_pixmap_with_value(0xFF);
+  mupdf::FzDevice dev{mat, pix, bbox};
+  list.fz_run_display_list(dev, mupdf::FzMatrix{}, bbox_doc.intersect(clip).fz_rect(), cookie);
+  dev.fz_close_device();
+}
+
+// Rasterize the part of `list` described by `geom` into `pix`, which covers `geom.irect`,
+// onto a white background. The pixmap is split into horizontal bands that are rendered in parallel
+// on `pool`, each of which renders into a pixmap sharing the samples of the full pixmap.
+// The bands can run the display list concurrently, since `mupdfcpp` uses a separate clone of its
+// context on each thread.
+// Rendering stops early if `cookie` is aborted, in which case the pixmap is incomplete.
+inline void render(mupdf::FzDisplayList& list, const GeomInfo& geom, mupdf::FzPixmap& pix,
+                   RenderCookie& cookie, ThreadPool& pool) {
+  const int height = geom.irect.y1 - geom.irect.y0;
+  const auto bands = std::clamp<std::size_t>(std::size_t(height / min_band_height), 1, pool.size());
+  const Rect clip{geom.rclip};
+
+  pool.parallel_for(bands, [&](std::size_t i) {
+    mupdf::FzIrect band_rect = geom.irect;
+    band_rect.y0 = geom.irect.y0 + int(std::size_t(height) * i / bands);
+    band_rect.y1 = geom.irect.y0 + int(std::size_t(height) * (i + 1) / bands);
+    if (band_rect.y0 == band_rect.y1) {
+      return;
+    }
+
+    mupdf::FzPixmap band = mupdf::fz_new_pixmap_from_pixmap(pix, band_rect);
+    render_into(list, geom.fzmat, geom.factor, clip, band, cookie.part(i));
+  });
+}
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_PDF_RENDER_HPP
@@ -0,0 +1,160 @@
+#ifndef INCLUDE_ILLUMINATA_PDF_STAGING_HPP
+#define INCLUDE_ILLUMINATA_PDF_STAGING_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace illa {
+// Memory provided for frames to be rendered into, e.g. a persistently mapped pixel buffer.
+struct StagingBuffer {
+  unsigned char* data;
+  std::size_t size;
+  // Identifies the buffer for its provider.
+  std::size_t index;
+};
+
+// The use of a staging buffer by a frame, which returns the buffer to its pool once the last
+// reference to the lease is dropped.
+struct StagingLease;
+
+// Staging buffers shared between the main thread, which provides them and uploads frames from them,
+// and the render worker, which renders frames into them.
+// Buffers are leased while they are written to or in use by a frame and are handed back to the
+// provider afterwards, which has to make sure that the GPU is done reading from a buffer before
+// providing it again. All member functions may be called from any thread.
+struct StagingPool {
+  StagingPool() = default;
+  StagingPool(const StagingPool&) = delete;
+  StagingPool(StagingPool&&) = delete;
+  StagingPool& operator=(const StagingPool&) = delete;
+  StagingPool& operator=(StagingPool&&) = delete;
+  ~StagingPool() = default;
+
+  // Make `buf` available for leasing.
+  void provide(StagingBuffer buf) {
+    std::scoped_lock lock{shared_->mutex};
+    shared_->free.push_back(buf);
+  }
+
+  // Lease a free buffer of at least `size` bytes for writing, if there is one.
+  // Writing ends with `StagingLease::finish` or when the lease is destroyed.
+  [[nodiscard]] std::shared_ptr<StagingLease> acquire(std::size_t size);
+
+  // Remove the free buffers smaller than `size`, e.g. since larger frames are expected,
+  // and return them to the provider.
+  [[nodiscard]] std::vector<StagingBuffer> withdraw_smaller(std::size_t size) {
+    std::scoped_lock lock{shared_->mutex};
+    std::vector<StagingBuffer> out{};
+    std::erase_if(shared_->free, [&](const StagingBuffer& buf) {
+      if (buf.size < size) {
+        out.push_back(buf);
+        return true;
+      }
+      return false;
+    });
+    return out;
+  }
+
+  // The buffers no longer leased since the last call, which the provider may provide again.
+  [[nodiscard]] std::vector<StagingBuffer> take_returned() {
+    std::scoped_lock lock{shared_->mutex};
+    return std::exchange(shared_->returned, {});
+  }
+
+  // Withdraw all buffers, e.g. because the memory is about to be released, and invalidate all
+  // leases. Blocks until no lease is written to anymore.
+  void revoke() {
+    std::unique_lock lock{shared_->mutex};
+    ++shared_->generation;
+    shared_->free.clear();
+    shared_->returned.clear();
+    shared_->cv.wait(lock, [&] { return shared_->writers == 0; });
+  }
+
+private:
+  friend struct StagingLease;
+
+  // Shared with the leases so that they can outlive the pool.
+  struct Shared {
+    std::mutex mutex{};
+    std::condition_variable cv{};
+    // Incremented whenever the buffers are revoked, which invalidates the leases of earlier ones.
+    std::uint64_t generation{0};
+    // The number of leases being written to.
+    std::size_t writers{0};
+    std::vector<StagingBuffer> free{};
+    std::vector<StagingBuffer> returned{};
+  };
+
+  std::shared_ptr<Shared> shared_{std::make_shared<Shared>()};
+};
+
+struct StagingLease {
+  StagingLease(std::shared_ptr<StagingPool::Shared> shared, StagingBuffer buf,
+               std::uint64_t generation)
+      : shared_{std::move(shared)}, buf_{buf}, generation_{generation} {}
+  StagingLease(const StagingLease&) = delete;
+  StagingLease(StagingLease&&) = delete;
+  StagingLease& operator=(const StagingLease&) = delete;
+  StagingLease& operator=(StagingLease&&) = delete;
+  ~StagingLease() {
+    std::scoped_lock lock{shared_->mutex};
+    end_writing();
+    if (generation_ == shared_->generation) {
+      shared_->returned.push_back(buf_);
+    }
+  }
+
+  // Called once the buffer has been written.
+  void finish() {
+    std::scoped_lock lock{shared_->mutex};
+    end_writing();
+  }
+
+  // Whether the buffer has not been revoked, i.e. whether its memory may still be accessed.
+  [[nodiscard]] bool valid() const {
+    std::scoped_lock lock{shared_->mutex};
+    return generation_ == shared_->generation;
+  }
+
+  [[nodiscard]] const StagingBuffer& buffer() const {
+    return buf_;
+  }
+
+private:
+  // Requires holding the mutex.
+  void end_writing() {
+    if (writing_) {
+      writing_ = false;
+      --shared_->writers;
+      shared_->cv.notify_all();
+    }
+  }
+
+  std::shared_ptr<StagingPool::Shared> shared_;
+  StagingBuffer buf_;
+  std::uint64_t generation_;
+  bool writing_{true};
+};
+
+inline std::shared_ptr<StagingLease> StagingPool::acquire(std::size_t size) {
+  std::scoped_lock lock{shared_->mutex};
+  auto& free = shared_->free;
+  for (auto it = free.begin(); it != free.end(); ++it) {
+    if (it->size >= size) {
+      const StagingBuffer buf = *it;
+      free.erase(it);
+      ++shared_->writers;
+      return std::make_shared<StagingLease>(shared_, buf, shared_->generation);
+    }
+  }
+  return nullptr;
+}
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_PDF_STAGING_HPP
@@ -0,0 +1,177 @@
+#ifndef INCLUDE_ILLUMINATA_PDF_TEXTURES_HPP
+#define INCLUDE_ILLUMINATA_PDF_TEXTURES_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "illuminata/opengl.hpp"
+
+namespace illa {
+// The immutable storage of a 2D array texture, which textures with the same storage can be used
+// for interchangeably.
+struct TextureSpec {
+  GLsizei width;
+  GLsizei height;
+  GLsizei layers{1};
+  GLsizei levels{1};
+  gl::InternalFormat format{gl::InternalFormat::rgba8};
+
+  bool operator==(const TextureSpec&) const = default;
+
+  // The memory occupied by the storage (in bytes), assuming that three components are padded
+  // to four as usual.
+  [[nodiscard]] std::size_t bytes() const {
+    std::size_t texel = 4;
+    switch (format) {
+    case gl::InternalFormat::r8: texel = 1; break;
+    case gl::InternalFormat::rg8: texel = 2; break;
+    case gl::InternalFormat::rgb8:
+    case gl::InternalFormat::rgba8: texel = 4; break;
+    }
+    std::size_t total = 0;
+    GLsizei w = width;
+    GLsizei h = height;
+    for (GLsizei level = 0; level < levels; ++level) {
+      total += std::size_t(w) * std::size_t(h);
+      w = std::max(w / 2, 1);
+      h = std::max(h / 2, 1);
+    }
+    return total * std::size_t(layers) * texel;
+  }
+};
+
+// The memory occupied by the textures of a `TexturePool` (in bytes).
+struct TextureUsage {
+  // The textures in use.
+  std::size_t used;
+  // The released textures kept for reuse.
+  std::size_t cached;
+  std::size_t budget;
+};
+
+// The textures of the view, which are kept within a memory budget so that caching textures does
+// not exhaust the memory of the GPU, which is shared with the system on many laptops.
+// Textures are handed out as shared pointers and are returned to the pool once the last reference
+// is dropped, where they are kept for reuse by later textures with the same storage instead of
+// deleting and allocating them again. Returned textures are only reused once the GPU is done with
+// the draws issued before `fence_released` is called in the context they are drawn in, and the
+// least recently returned ones are deleted when the budget would be exceeded otherwise.
+// Textures can be returned on any thread, even without a current context, while all other member
+// functions require a context sharing the textures to be current.
+struct TexturePool {
+  explicit TexturePool(std::size_t budget) {
+    shared_->budget = budget;
+  }
+  TexturePool(const TexturePool&) = delete;
+  TexturePool(TexturePool&&) = delete;
+  TexturePool& operator=(const TexturePool&) = delete;
+  TexturePool& operator=(TexturePool&&) = delete;
+  // Requires the textures to have been deleted with `clear`.
+  ~TexturePool() = default;
+
+  // A texture with the storage `spec`, which is a returned texture if there is one that can be
+  // reused, or `nullptr` if the textures in use leave no room for it within the budget.
+  // The sampler state of a reused texture is that set by its previous user.
+  [[nodiscard]] std::shared_ptr<gl::Texture> acquire(const TextureSpec& spec) {
+    std::scoped_lock lock{shared_->mutex};
+    const std::size_t bytes = spec.bytes();
+    auto& idle = shared_->idle;
+    for (auto it = idle.rbegin(); it != idle.rend(); ++it) {
+      if (it->spec == spec && it->fence != nullptr && it->fence->signaled()) {
+        gl::Texture tex = std::move(it->tex);
+        shared_->cached -= bytes;
+        idle.erase(std::next(it).base());
+        return wrap(std::move(tex), spec);
+      }
+    }
+
+    // Deleting textures the GPU may still use is fine, since the GL defers deleting them.
+    while (shared_->used + shared_->cached + bytes > shared_->budget && !idle.empty()) {
+      shared_->cached -= idle.front().spec.bytes();
+      idle.pop_front();
+    }
+    if (shared_->used + bytes > shared_->budget) {
+      return nullptr;
+    }
+
+    gl::Texture tex{gl::TextureKind::texture_2d_array};
+    {
+      auto tex_ctx = tex.bind();
+      tex.allocate_layers(spec.width, spec.height, spec.layers, spec.format, spec.levels);
+    }
+    return wrap(std::move(tex), spec);
+  }
+
+  // Create a fence after the draws issued in the current context so far, once the GPU has passed
+  // which the textures returned until now can be reused. To be called in the context the textures
+  // are drawn in, where all draws using a texture are issued before it is returned.
+  void fence_released() {
+    std::scoped_lock lock{shared_->mutex};
+    std::shared_ptr<gl::Fence> fence{};
+    for (Idle& entry : shared_->idle) {
+      if (entry.fence == nullptr) {
+        if (fence == nullptr) {
+          fence = std::make_shared<gl::Fence>();
+        }
+        entry.fence = fence;
+      }
+    }
+  }
+
+  // Delete all returned textures.
+  void clear() {
+    std::scoped_lock lock{shared_->mutex};
+    shared_->idle.clear();
+    shared_->cached = 0;
+  }
+
+  [[nodiscard]] TextureUsage usage() const {
+    std::scoped_lock lock{shared_->mutex};
+    return {.used = shared_->used, .cached = shared_->cached, .budget = shared_->budget};
+  }
+
+private:
+  // A returned texture.
+  struct Idle {
+    gl::Texture tex;
+    TextureSpec spec;
+    // The fence after which the texture can be reused, once it has been created.
+    std::shared_ptr<gl::Fence> fence;
+  };
+
+  // Shared with the textures in use, which may be returned after the pool is gone.
+  struct Shared {
+    std::mutex mutex{};
+    std::size_t budget{};
+    std::size_t used{0};
+    std::size_t cached{0};
+    // The returned textures, least recently returned first.
+    std::list<Idle> idle{};
+  };
+
+  // Requires holding the mutex.
+  std::shared_ptr<gl::Texture> wrap(gl::Texture tex, const TextureSpec& spec) {
+    shared_->used += spec.bytes();
+    return std::shared_ptr<gl::Texture>(
+      new gl::Texture(std::move(tex)), [shared = shared_, spec](gl::Texture* ptr) {
+        {
+          std::scoped_lock lock{shared->mutex};
+          shared->used -= spec.bytes();
+          shared->cached += spec.bytes();
+          shared->idle.push_back(Idle{.tex = std::move(*ptr), .spec = spec, .fence = nullptr});
+        }
+        // Does not call into the GL, since the texture has been moved from.
+        delete ptr;
+      });
+  }
+
+  std::shared_ptr<Shared> shared_{std::make_shared<Shared>()};
+};
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_PDF_TEXTURES_HPP
@@ -0,0 +1,167 @@
+#ifndef INCLUDE_ILLUMINATA_PDF_TILES_HPP
+#define INCLUDE_ILLUMINATA_PDF_TILES_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "illuminata/geometry.hpp"
+#include "illuminata/log.hpp"
+#include "illuminata/mupdf.hpp"
+#include "illuminata/pdf/pixmaps.hpp"
+#include "illuminata/pdf/render.hpp"
+#include "illuminata/threads.hpp"
+
+namespace illa {
+// The edge length of the square tiles (in pixels).
+inline constexpr int tile_size = 256;
+
+// Copy the part of `src` that overlaps `dst` into `dst`, which have the same pixel format.
+inline void copy_overlap(mupdf::FzPixmap& src, mupdf::FzPixmap& dst) {
+  const mupdf::FzIrect sbox = src.fz_pixmap_bbox();
+  const mupdf::FzIrect dbox = dst.fz_pixmap_bbox();
+  const mupdf::FzIrect r = intersect(sbox, dbox);
+  const auto n = std::size_t(src.n());
+  const auto row = std::size_t(r.x1 - r.x0) * n;
+  for (int y = r.y0; y < r.y1; ++y) {
+    const unsigned char* s =
+      src.samples() + std::ptrdiff_t(y - sbox.y0) * src.stride() + std::size_t(r.x0 - sbox.x0) * n;
+    unsigned char* d =
+      dst.samples() + std::ptrdiff_t(y - dbox.y0) * dst.stride() + std::size_t(r.x0 - dbox.x0) * n;
+    std::memcpy(d, s, row);
+  }
+}
+
+// A tile on the pixel grid of a page rendered at a zoom level.
+struct TileKey {
+  // The identity of the display list the tile has been rendered from.
+  const void* list;
+  int level;
+  int x, y;
+
+  bool operator==(const TileKey&) const = default;
+};
+
+struct TileKeyHash {
+  std::size_t operator()(const TileKey& key) const {
+    std::size_t h = std::hash<const void*>{}(key.list);
+    for (const int v : {key.level, key.x, key.y}) {
+      h ^= std::hash<int>{}(v) + 0x9E3779B97F4A7C15ULL + (h << 6U) + (h >> 2U);
+    }
+    return h;
+  }
+};
+
+// A cache of rendered tiles on a fixed pixel grid for each page and zoom level,
+// from which frames are composed so that only tiles that have not been rendered before are
+// rasterized, e.g. those newly exposed when panning or those at a new zoom level.
+// The least recently used tiles are evicted once the tiles occupy more than `budget` bytes.
+// Only used by the render worker thread.
+struct TileCache {
+  explicit TileCache(std::size_t budget) : budget_{budget} {}
+
+  // Compose the part of `list` described by `geom` from tiles into `frame`, which covers
+  // `geom.irect`, rendering the missing tiles in parallel on `pool` into buffers from `pixmaps`.
+  // If `cookie` is aborted, the frame is incomplete and no tiles are cached.
+  void render(mupdf::FzDisplayList& list, const GeomInfo& geom, mupdf::FzPixmap& frame,
+              RenderCookie& cookie, ThreadPool& pool, PixmapPool& pixmaps) {
+    const int level = zoom_level(geom.factor);
+    const mupdf::FzIrect page = geom.page_irect();
+    const mupdf::FzIrect& view = geom.irect;
+    if (view.x0 >= view.x1 || view.y0 >= view.y1) {
+      return;
+    }
+
+    // Declared before `tiles` so that the buffers of the tiles that are not cached or evicted
+    // are only returned once the pixmaps are dropped.
+    std::vector<std::optional<PooledPixmap>> rendered{};
+    Lru evicted{};
+    std::vector<mupdf::FzPixmap> tiles{};
+    std::vector<std::pair<TileKey, mupdf::FzIrect>> missing{};
+    for (int ty = floor_div(view.y0, tile_size); ty * tile_size < view.y1; ++ty) {
+      for (int tx = floor_div(view.x0, tile_size); tx * tile_size < view.x1; ++tx) {
+        const TileKey key{.list = list.m_internal, .level = level, .x = tx, .y = ty};
+        if (auto it = index_.find(key); it != index_.end()) {
+          lru_.splice(lru_.begin(), lru_, it->second);
+          tiles.push_back(it->second->pix);
+          continue;
+        }
+        const mupdf::FzIrect tile{tx * tile_size, ty * tile_size, (tx + 1) * tile_size,
+                                  (ty + 1) * tile_size};
+        missing.emplace_back(key, intersect(tile, page));
+      }
+    }
+    hits_ += tiles.size();
+    misses_ += missing.size();
+    log("tiles: {} cached, {} to render, {} bytes in cache; {} hits, {} misses, {} evictions\n",
+        tiles.size(), missing.size(), bytes_, hits_, misses_, evictions_);
+
+    rendered.resize(missing.size());
+    const Rect clip{geom.bounds};
+    pool.parallel_for(missing.size(), [&](std::size_t i) {
+      mupdf::FzPixmap& pix = rendered[i].emplace(pixmaps.new_pixmap(missing[i].second)).pix;
+      render_into(list, geom.fzmat, geom.factor, clip, pix, cookie.part(i));
+    });
+
+    const bool complete = !cookie.aborted();
+    for (std::size_t i = 0; i < missing.size(); ++i) {
+      tiles.push_back(rendered[i]->pix);
+      if (complete) {
+        insert(list, missing[i].first, std::move(*rendered[i]), evicted);
+      }
+    }
+    pool.parallel_for(tiles.size(), [&](std::size_t i) { copy_overlap(tiles[i], frame); });
+  }
+
+private:
+  struct Entry {
+    TileKey key;
+    // Keeps the display list alive so that its address cannot be reused for another one.
+    mupdf::FzDisplayList list;
+    // Declared before `pix` so that the buffer is returned after the pixmap is dropped.
+    std::shared_ptr<unsigned char[]> samples;
+    mupdf::FzPixmap pix;
+    std::size_t bytes;
+  };
+  using Lru = std::list<Entry>;
+
+  // Cache `tile`, moving the tiles evicted to stay within the budget into `evicted`.
+  void insert(mupdf::FzDisplayList& list, const TileKey& key, PooledPixmap tile, Lru& evicted) {
+    const auto size = std::size_t(tile.pix.h()) * std::size_t(tile.pix.stride());
+    lru_.push_front(Entry{
+      .key = key,
+      .list = list,
+      .samples = std::move(tile.samples),
+      .pix = std::move(tile.pix),
+      .bytes = size,
+    });
+    index_.insert_or_assign(key, lru_.begin());
+    bytes_ += size;
+    while (bytes_ > budget_ && !lru_.empty()) {
+      bytes_ -= lru_.back().bytes;
+      index_.erase(lru_.back().key);
+      evicted.splice(evicted.end(), lru_, std::prev(lru_.end()));
+      ++evictions_;
+    }
+  }
+
+  std::size_t budget_;
+  std::size_t bytes_{0};
+  std::size_t hits_{0};
+  std::size_t misses_{0};
+  std::size_t evictions_{0};
+  // The cached tiles, most recently used first.
+  Lru lru_{};
+  std::unordered_map<TileKey, Lru::iterator, TileKeyHash> index_{};
+};
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_PDF_TILES_HPP
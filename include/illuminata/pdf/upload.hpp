@@ -0,0 +1,521 @@
+#ifndef INCLUDE_ILLUMINATA_PDF_UPLOAD_HPP
+#define INCLUDE_ILLUMINATA_PDF_UPLOAD_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "illuminata/log.hpp"
+#include "illuminata/mupdf.hpp"
+#include "illuminata/opengl.hpp"
+#include "illuminata/pdf/atlas.hpp"
+#include "illuminata/pdf/render.hpp"
+#include "illuminata/pdf/staging.hpp"
+#include "illuminata/pdf/textures.hpp"
+#include "illuminata/pdf/worker.hpp"
+
+namespace illa {
+// Objects owning GL objects whose last reference may be dropped on any thread, including threads
+// without a current context, so that deleting them is deferred until `clear` is called with a
+// context sharing them current. All member functions may be called from any thread.
+struct Graveyard {
+  // Move `obj` into shared ownership, where it is buried in `graveyard` once the last reference
+  // to it is dropped.
+  template<typename T>
+  static std::shared_ptr<T> make(std::shared_ptr<Graveyard> graveyard, T obj) {
+    return std::shared_ptr<T>(new T(std::move(obj)), [graveyard = std::move(graveyard)](T* ptr) {
+      graveyard->bury(std::shared_ptr<void>(ptr));
+    });
+  }
+
+  void bury(std::shared_ptr<void> obj) {
+    std::scoped_lock lock{mutex_};
+    buried_.push_back(std::move(obj));
+  }
+
+  // Delete the buried objects. Requires a context sharing them to be current.
+  void clear() {
+    std::vector<std::shared_ptr<void>> buried{};
+    {
+      std::scoped_lock lock{mutex_};
+      buried.swap(buried_);
+    }
+    // Destroyed without holding the mutex, since destructors may bury further objects.
+    buried.clear();
+  }
+
+private:
+  std::mutex mutex_{};
+  std::vector<std::shared_ptr<void>> buried_{};
+};
+
+// A whole page with a full mip chain, from which views at its zoom level or lower ones are
+// minified with trilinear filtering instead of rendering them again.
+// A texture array with a single layer, so that it is drawn like the tile atlas.
+struct PageTexture {
+  std::shared_ptr<gl::Texture> tex;
+  // Keeps the display list alive so that its address cannot be reused for another one.
+  mupdf::FzDisplayList list;
+  GeomInfo geom;
+  // The fence after uploading the texture and computing its mip chain.
+  gl::Fence fence;
+};
+
+// Uploads frames into a texture atlas of tiles, see `TileAtlas`, and keeps the frames showing
+// whole pages as page textures. Frames can be uploaded on any thread with a current context
+// sharing objects with the context they are drawn in, in particular by the render worker right
+// after rendering them, so that drawing a frame only waits for the fence after its upload on the
+// GPU and binds its texture. The tiles of a frame are pinned in the atlas as long as the frame
+// exists, so that uploading other frames never overwrites them while they may be drawn.
+// The textures are taken from a `TexturePool`, whose budget covers the atlas and the page textures.
+// All member functions may be called from any thread with a context sharing the objects current.
+struct FrameUploader {
+  // The default memory budget of the textures (in bytes).
+  static constexpr std::size_t default_texture_budget = std::size_t{256} << 20U;
+  // The granularity of the number of layers of the atlas, which grows as more tiles are needed.
+  static constexpr int layer_granularity = 32;
+  // The largest dimensions of a page texture (in pixels).
+  static constexpr int page_texture_limit = 4096;
+  // The number of page textures kept, which covers the current page and those rendered ahead.
+  static constexpr std::size_t page_texture_count = 3;
+  // The number of staging buffers, which covers the current frame, the frames rendered ahead of
+  // time, and the frame being rendered.
+  static constexpr std::size_t staging_count = 4;
+  // The default memory budget of the staging buffers (in bytes). Fewer than `staging_count`
+  // buffers are provided if they do not fit, e.g. for large views, in which case the remaining
+  // frames are uploaded through the pixel buffers.
+  static constexpr std::size_t default_staging_budget = std::size_t{128} << 20U;
+
+  explicit FrameUploader(std::size_t budget = default_texture_budget,
+                         std::size_t staging_budget = default_staging_budget)
+      : textures_{budget}, staging_budget_{staging_budget} {}
+  FrameUploader(const FrameUploader&) = delete;
+  FrameUploader(FrameUploader&&) = delete;
+  FrameUploader& operator=(const FrameUploader&) = delete;
+  FrameUploader& operator=(FrameUploader&&) = delete;
+  ~FrameUploader() = default;
+
+  // Called once a context is available, where frames can be rendered into buffers provided to
+  // `pool` if persistent mapping is supported.
+  void realize(StagingPool& pool) {
+    std::scoped_lock lock{shared_->mutex};
+    pbos_.emplace();
+    if (gl::PixelBuffer::persistent_mapping_supported()) {
+      staging_pool_ = &pool;
+    }
+    // Makes the pixel buffers available to the other contexts.
+    glFlush();
+  }
+
+  // Delete all GL objects. Requires that no frames rendered into staging buffers or uploaded are
+  // used anymore and that no other thread uploads frames.
+  void unrealize() {
+    if (staging_pool_ != nullptr) {
+      // Waits for the render worker to stop writing into the buffers before deleting them.
+      staging_pool_->revoke();
+    }
+    {
+      std::scoped_lock lock{shared_->mutex};
+      staging_pool_ = nullptr;
+      staging_.clear();
+      draining_.clear();
+      tex_.reset();
+      pages_.clear();
+      shared_->atlas.clear();
+      ++shared_->generation;
+      for (auto& fence : fences_) {
+        fence.reset();
+      }
+      next_pbo_ = 0;
+      pbos_.reset();
+    }
+    graveyard_->clear();
+    textures_.clear();
+  }
+
+  // Delete the objects released since the last call, e.g. those of frames that have been dropped.
+  void collect() {
+    graveyard_->clear();
+  }
+
+  // Allow the textures released so far to be reused once the draws issued before are done,
+  // see `TexturePool::fence_released`. To be called in the context frames are drawn in.
+  void fence_released() {
+    textures_.fence_released();
+  }
+
+  // The memory occupied by the textures, for instrumentation.
+  [[nodiscard]] TextureUsage texture_usage() const {
+    return textures_.usage();
+  }
+
+  // Provide up to `staging_count` staging buffers of at least `size` bytes to the staging pool,
+  // as many as fit within the staging budget, reusing the buffers returned by the pool once the
+  // GPU is done reading from them.
+  void provide_staging(std::size_t size) {
+    std::scoped_lock lock{shared_->mutex};
+    if (staging_pool_ == nullptr) {
+      return;
+    }
+
+    for (const StagingBuffer& buf : staging_pool_->withdraw_smaller(size)) {
+      staging_[buf.index].reset();
+    }
+    for (const StagingBuffer& buf : staging_pool_->take_returned()) {
+      draining_.push_back(buf.index);
+    }
+    std::erase_if(draining_, [&](std::size_t i) {
+      Staging& st = *staging_[i];
+      if (st.fence.has_value() && !st.fence->signaled()) {
+        return false;
+      }
+      st.fence.reset();
+      if (st.buf.size < size) {
+        staging_[i].reset();
+      } else {
+        staging_pool_->provide(st.buf);
+      }
+      return true;
+    });
+
+    bool created = false;
+    std::size_t live = 0;
+    std::size_t bytes = 0;
+    for (const auto& st : staging_) {
+      if (st.has_value()) {
+        ++live;
+        bytes += st->buf.size;
+      }
+    }
+    for (std::size_t i = 0; live < staging_count && bytes + size <= staging_budget_; ++i) {
+      if (i == staging_.size()) {
+        staging_.emplace_back();
+      }
+      if (staging_[i].has_value()) {
+        continue;
+      }
+      Staging& st = staging_[i].emplace();
+      auto pbo_ctx = st.pbo.bind();
+      st.buf = StagingBuffer{
+        .data = st.pbo.allocate_persistent(GLsizeiptr(size)),
+        .size = size,
+        .index = i,
+      };
+      staging_pool_->provide(st.buf);
+      created = true;
+      ++live;
+      bytes += size;
+    }
+    if (created) {
+      log("staging: {} buffers, {} MiB\n", live, bytes >> 20U);
+      // Makes the new buffers available to the other contexts before frames are uploaded from
+      // them.
+      glFlush();
+    }
+  }
+
+  // Upload the parts of `frame` whose tiles are not resident in the atlas yet, and the frame as a
+  // page texture if it shows a whole page with more detail than the page texture of that page,
+  // directly from its staging buffer if it has one and through the next pixel buffer otherwise.
+  // If not all tiles of the frame can be made resident, since too many are pinned, only the first
+  // ones are uploaded if `partial` is true, and nothing is uploaded and `nullptr` is returned
+  // otherwise. The commands are flushed so that the frame can be drawn in another context.
+  [[nodiscard]] std::shared_ptr<FrameUpload> upload(Frame& frame, bool partial);
+
+  // The page texture of the page with display list `list` if it has at least the detail needed
+  // at the zoom level `factor`, so that views at that zoom level need not be rendered.
+  [[nodiscard]] std::shared_ptr<const PageTexture> page_texture(const mupdf::FzDisplayList& list,
+                                                                float factor) const {
+    std::scoped_lock lock{shared_->mutex};
+    for (const auto& page : pages_) {
+      if (page->list.m_internal == list.m_internal && factor <= page->geom.factor) {
+        return page;
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  friend struct FrameUpload;
+
+  // The state shared with the uploaded frames, which may outlive the uploader.
+  struct Shared {
+    // Guards the state of the uploader as well.
+    std::mutex mutex{};
+    // Incremented whenever the atlas is cleared, which invalidates the pins of earlier frames.
+    std::uint64_t generation{0};
+    TileAtlas atlas{};
+  };
+
+  // A persistently mapped pixel buffer provided to the render worker, so that frames are rendered
+  // directly into memory the GPU uploads from, without copying them.
+  struct Staging {
+    gl::PixelBuffer pbo;
+    StagingBuffer buf;
+    // The fence after the last upload from the buffer, if any.
+    std::optional<gl::Fence> fence;
+  };
+
+  // The storage of an atlas texture with `layers` layers.
+  static TextureSpec atlas_spec(int layers) {
+    return {.width = atlas_tile_size, .height = atlas_tile_size, .layers = layers};
+  }
+
+  // The maximum number of layers of the atlas within the budget and the limits of the GL.
+  [[nodiscard]] int max_layers() const {
+    const std::size_t layer_bytes = atlas_spec(1).bytes();
+    return int(std::min<std::size_t>(std::max<std::size_t>(
+                                       textures_.usage().budget / layer_bytes, 1),
+                                     std::size_t(gl::Texture::max_layers())));
+  }
+
+  // Make sure that the atlas has enough layers for the tiles of the frame covering `box`
+  // in addition to the resident ones, up to `max_layers()` and as far as the texture pool has room
+  // for a larger texture. If the atlas has to grow, a texture with more layers is acquired,
+  // into which the layers of the old one are copied. The old texture is returned to the pool once
+  // the frames drawn from it are dropped. Requires holding the mutex.
+  void reserve(const mupdf::FzDisplayList& list, float factor, const mupdf::FzIrect& box) {
+    TileAtlas& atlas = shared_->atlas;
+    const int limit = max_layers();
+    const int current = atlas.layers();
+    const auto needed = int(std::min(atlas.layers_needed(list, factor, box), std::size_t(limit)));
+    if (tex_ != nullptr && needed <= current) {
+      return;
+    }
+    int layers = std::min(
+      (std::max(needed, 1) + layer_granularity - 1) / layer_granularity * layer_granularity, limit);
+
+    // While frames are drawn from the old texture, both count against the budget, so fewer layers
+    // than needed are better than none.
+    std::shared_ptr<gl::Texture> next{};
+    for (; layers > current; layers -= layer_granularity) {
+      next = textures_.acquire(atlas_spec(layers));
+      if (next != nullptr) {
+        break;
+      }
+    }
+    if (next == nullptr) {
+      log("atlas stays at {} layers: texture budget exhausted\n", current);
+      return;
+    }
+    log("allocate atlas: {} layers\n", layers);
+
+    {
+      auto tex_ctx = next->bind();
+      next->set_sampling(GL_LINEAR, GL_CLAMP_TO_EDGE);
+      // The BGRA frames are uploaded as RGBA, since GLES only accepts BGRA with an extension,
+      // and the red and blue components are swapped back when sampling.
+      next->set_swizzle(GL_BLUE, GL_GREEN, GL_RED, GL_ALPHA);
+    }
+    if (tex_ != nullptr && current > 0) {
+      const auto target = static_cast<GLenum>(gl::TextureKind::texture_2d_array);
+      glCopyImageSubData(tex_->id(), target, 0, 0, 0, 0, next->id(), target, 0, 0, 0, 0,
+                         atlas_tile_size, atlas_tile_size, current);
+    }
+    tex_ = std::move(next);
+    atlas.grow(layers);
+  }
+
+  // Whether to keep `frame` as a page texture, i.e. whether it shows the whole page within
+  // `page_texture_limit` and there is no page texture of the page with at least as much detail.
+  // Requires holding the mutex.
+  [[nodiscard]] bool keeps_page(const Frame& frame) const {
+    const mupdf::FzIrect& box = frame.geom.irect;
+    const mupdf::FzIrect page_box = frame.geom.page_irect();
+    const int limit = std::min(page_texture_limit, int(gl::Texture::max_size()));
+    const bool whole = box.x0 <= page_box.x0 && box.y0 <= page_box.y0 && page_box.x1 <= box.x1 &&
+                       page_box.y1 <= box.y1;
+    return whole && frame.pix.w() <= limit && frame.pix.h() <= limit &&
+           std::none_of(pages_.begin(), pages_.end(), [&](const auto& page) {
+             return page->list.m_internal == frame.display_list.m_internal &&
+                    frame.geom.factor <= page->geom.factor;
+           });
+  }
+
+  // Upload the tile parts `parts` of `pix` from the bound pixel buffer holding its samples.
+  void upload_parts(mupdf::FzPixmap& pix, const std::vector<AtlasPart>& parts) {
+    const mupdf::FzIrect box = pix.fz_pixmap_bbox();
+    const auto n = std::ptrdiff_t(pix.n());
+    auto tex_ctx = tex_->bind();
+    for (const AtlasPart& part : parts) {
+      const mupdf::FzIrect& r = part.rect;
+      // With a pixel buffer bound, the data pointer is an offset into it.
+      const std::ptrdiff_t offset = (r.y0 - box.y0) * pix.stride() + (r.x0 - box.x0) * n;
+      tex_->update_layer(reinterpret_cast<const std::uint8_t*>(offset),
+                         floor_mod(r.x0, atlas_tile_size), floor_mod(r.y0, atlas_tile_size),
+                         part.layer, r.x1 - r.x0, r.y1 - r.y0, GLint(pix.stride() / n),
+                         gl::PixelFormat::rgba);
+    }
+  }
+
+  // Keep `frame` as the page texture of its page, uploading it from the bound pixel buffer
+  // holding its samples and computing its mip chain. If the texture pool has no room for it,
+  // the least recently created page textures are dropped, and the frame is not kept if that does
+  // not suffice either. Requires holding the mutex.
+  void upload_page(Frame& frame) {
+    mupdf::FzPixmap& pix = frame.pix;
+    const int w = pix.w();
+    const int h = pix.h();
+    std::erase_if(pages_, [&](const auto& page) {
+      return page->list.m_internal == frame.display_list.m_internal;
+    });
+    const TextureSpec spec{.width = w, .height = h, .levels = gl::Texture::mip_levels(w, h)};
+    std::shared_ptr<gl::Texture> ptex = textures_.acquire(spec);
+    while (ptex == nullptr && !pages_.empty()) {
+      // Returns the texture right away unless the page texture is being drawn, since no other
+      // references can be taken while the mutex is held.
+      if (pages_.back().use_count() == 1) {
+        pages_.back()->tex.reset();
+      }
+      pages_.pop_back();
+      ptex = textures_.acquire(spec);
+    }
+    if (ptex == nullptr) {
+      log("no page texture: texture budget exhausted\n");
+      return;
+    }
+    {
+      auto tex_ctx = ptex->bind();
+      ptex->set_sampling(GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE);
+      ptex->set_swizzle(GL_BLUE, GL_GREEN, GL_RED, GL_ALPHA);
+      // With a pixel buffer bound, the data pointer is an offset into it.
+      ptex->update_layer(nullptr, 0, 0, 0, w, h, GLint(pix.stride() / pix.n()),
+                         gl::PixelFormat::rgba);
+      ptex->generate_mipmaps();
+    }
+
+    pages_.insert(pages_.begin(), Graveyard::make(graveyard_, PageTexture{
+                                                                .tex = std::move(ptex),
+                                                                .list = frame.display_list,
+                                                                .geom = frame.geom,
+                                                                .fence = gl::Fence{},
+                                                              }));
+    if (pages_.size() > page_texture_count) {
+      pages_.pop_back();
+    }
+  }
+
+  TexturePool textures_;
+  std::shared_ptr<Shared> shared_{std::make_shared<Shared>()};
+  std::shared_ptr<Graveyard> graveyard_{std::make_shared<Graveyard>()};
+  // The texture holding the tiles of `shared_->atlas`, with one tile of
+  // `atlas_tile_size`×`atlas_tile_size` texels per layer, which is replaced by one with more
+  // layers when more tiles are needed, up to the budget. Acquired when uploading the first frame.
+  std::shared_ptr<gl::Texture> tex_{};
+  // The page textures, most recently created first.
+  std::vector<std::shared_ptr<PageTexture>> pages_{};
+  // The pixel buffers through which frames are uploaded, used alternately so that writing a frame
+  // does not have to wait for the upload of the previous frame to complete.
+  std::optional<std::array<gl::PixelBuffer, 2>> pbos_{};
+  // For each pixel buffer, the fence after the last upload from it, if it has not been waited for.
+  std::array<std::optional<gl::Fence>, 2> fences_{};
+  // The index of the pixel buffer to use for the next upload.
+  std::size_t next_pbo_{0};
+  // The memory budget of the staging buffers (in bytes).
+  std::size_t staging_budget_;
+  // The pool the staging buffers are provided to, if persistent mapping is supported.
+  StagingPool* staging_pool_{};
+  // The staging buffers, indexed by `StagingBuffer::index`.
+  std::vector<std::optional<Staging>> staging_{};
+  // The indices of the staging buffers returned by the pool whose last upload may not be done.
+  std::vector<std::size_t> draining_{};
+};
+
+// A frame uploaded by `FrameUploader`: The parts of the frame held by the layers of the atlas
+// texture, which stay pinned until the upload is dropped, and the fence after the upload.
+// Buried in the graveyard of the uploader once dropped, since it owns GL objects.
+struct FrameUpload {
+  FrameUpload(std::shared_ptr<FrameUploader::Shared> shared, std::uint64_t generation,
+              std::shared_ptr<gl::Texture> texture, std::vector<AtlasPart> parts)
+      : texture{std::move(texture)}, parts{std::move(parts)}, shared_{std::move(shared)},
+        generation_{generation} {}
+  FrameUpload(const FrameUpload&) = delete;
+  FrameUpload(FrameUpload&& other) noexcept
+      : texture{std::move(other.texture)}, parts{std::move(other.parts)},
+        fence{std::move(other.fence)}, shared_{std::move(other.shared_)},
+        generation_{other.generation_} {}
+  FrameUpload& operator=(const FrameUpload&) = delete;
+  FrameUpload& operator=(FrameUpload&&) = delete;
+  ~FrameUpload() {
+    if (shared_ == nullptr) {
+      return;
+    }
+    std::scoped_lock lock{shared_->mutex};
+    if (generation_ == shared_->generation) {
+      shared_->atlas.unpin(parts);
+    }
+  }
+
+  std::shared_ptr<gl::Texture> texture;
+  // The parts of the frame held by the layers of `texture` (pixel coordinates).
+  std::vector<AtlasPart> parts;
+  std::optional<gl::Fence> fence{};
+
+private:
+  std::shared_ptr<FrameUploader::Shared> shared_;
+  std::uint64_t generation_;
+};
+
+inline std::shared_ptr<FrameUpload> FrameUploader::upload(Frame& frame, bool partial) {
+  collect();
+  std::scoped_lock lock{shared_->mutex};
+  TileAtlas& atlas = shared_->atlas;
+  mupdf::FzPixmap& pix = frame.pix;
+  const mupdf::FzIrect box = pix.fz_pixmap_bbox();
+  reserve(frame.display_list, frame.geom.factor, box);
+  if (tex_ == nullptr) {
+    return nullptr;
+  }
+  std::optional<TilePlacement> placed = atlas.place(frame.display_list, frame.geom.factor, box,
+                                                    partial);
+  if (!placed.has_value()) {
+    return nullptr;
+  }
+  atlas.pin(placed->parts);
+  const bool keep_page = keeps_page(frame);
+  log("upload {} tile parts, {} tiles resident{}\n", placed->uploads.size(), atlas.size(),
+      keep_page ? ", page texture" : "");
+  auto out = Graveyard::make(
+    graveyard_, FrameUpload{shared_, shared_->generation, tex_, std::move(placed->parts)});
+
+  if (!placed->uploads.empty() || keep_page) {
+    if (const StagingLease* lease = frame.staging.get(); lease != nullptr) {
+      assert(staging_pool_ != nullptr && lease->valid());
+      Staging& st = *staging_[lease->buffer().index];
+      auto pbo_ctx = st.pbo.bind();
+      upload_parts(pix, placed->uploads);
+      if (keep_page) {
+        upload_page(frame);
+      }
+      st.fence.emplace();
+    } else {
+      // Only waits if the upload from this pixel buffer two frames ago has not completed yet.
+      if (auto& fence = fences_[next_pbo_]; fence.has_value()) {
+        fence->wait();
+        fence.reset();
+      }
+      gl::PixelBuffer& pbo = (*pbos_)[next_pbo_];
+      auto pbo_ctx = pbo.bind();
+      pbo.write(pix.samples(), GLsizeiptr(pix.stride()) * pix.h());
+      upload_parts(pix, placed->uploads);
+      if (keep_page) {
+        upload_page(frame);
+      }
+      fences_[next_pbo_].emplace();
+      next_pbo_ = (next_pbo_ + 1) % pbos_->size();
+    }
+  }
+  out->fence.emplace();
+  glFlush();
+  return out;
+}
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_PDF_UPLOAD_HPP
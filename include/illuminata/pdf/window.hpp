@@ -4,10 +4,13 @@
 #include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
 #include <memory>
 #include <optional>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 
 #include <gdk/gdk.h>
@@ -22,9 +25,14 @@
 
 #include "illuminata/fmt.hpp"
 #include "illuminata/geometry.hpp"
+#include "illuminata/log.hpp"
 #include "illuminata/mupdf.hpp"
 #include "illuminata/pdf/info.hpp"
+#include "illuminata/pdf/pixmaps.hpp"
+#include "illuminata/pdf/render.hpp"
+#include "illuminata/pdf/tiles.hpp"
 #include "illuminata/pdf/transform.hpp"
+#include "illuminata/pdf/worker.hpp"
 
 #if ILLUMINATA_OPENGL
 #include "illuminata/pdf/opengl.hpp"
@@ -33,28 +41,32 @@
 #endif
 
 namespace illa {
-template<typename... T>
-inline void log([[maybe_unused]] fmt::format_string<T...> fmt, [[maybe_unused]] T&&... args) {
-#if ILLUMINATA_PRINT
-  fmt::print(fmt, std::forward<T>(args)...);
+// The sizes of the caches of the viewer, e.g. set on the command line.
+struct ViewerConfig {
+  // The memory budget of the tiles rendered by the render worker (in bytes).
+  std::size_t tile_budget{RenderWorker::default_tile_budget};
+  // The memory budget of the sample buffers kept for reuse by the render worker (in bytes).
+  std::size_t pixmap_budget{PixmapPool::default_budget};
+#if ILLUMINATA_OPENGL
+  // The memory budget of the textures (in bytes).
+  std::size_t texture_budget{FrameUploader::default_texture_budget};
+  // The memory budget of the buffers frames are rendered into for uploading (in bytes).
+  std::size_t staging_budget{FrameUploader::default_staging_budget};
 #endif
-}
+  PrefetchConfig prefetch{};
+};
 
 struct PdfViewer : public Adw::ApplicationWindow {
-  struct GeomInfo {
-    Dims<int> dims_base;
-    Dims<int> dims_scaled;
-    int scale;
-    float factor;
-    mupdf::FzMatrix fzmat;
-    Vec2<float> offset;
-    mupdf::FzRect rclip;
-    mupdf::FzIrect irect;
-  };
-
   using Clock = std::chrono::steady_clock;
   using Dur = std::chrono::duration<double>;
 
+  // The margin rendered around the visible area (in pixels), so that panning, in particular by
+  // dragging, only moves the frame until the margin is exhausted.
+  static constexpr int overscan = 2 * tile_size;
+  // The time after the last zoom step after which the page is rendered at the new zoom level.
+  static constexpr unsigned zoom_settle_ms = 150;
+
+  ViewerConfig config;
   std::optional<PdfInfo> pdf{};
   bool invert{};
 
@@ -63,10 +75,47 @@ struct PdfViewer : public Adw::ApplicationWindow {
   Transform transform{};
 
 #if ILLUMINATA_OPENGL
-  OpenGlState ogl{};
+  OpenGlState ogl;
+#else
+  // The source pattern of the frame with ID `pattern_frame`, which refers to the samples of its
+  // pixmap, so that it is only created once per frame rather than on every draw.
+  std::shared_ptr<Cairo::Pattern> frame_pattern{};
+  std::optional<std::uint64_t> pattern_frame{};
 #endif
 
-  explicit PdfViewer(Adw::Application& app, std::optional<std::filesystem::path> path = {}) {
+  // The most recent frame finished by `worker`.
+  std::optional<Frame> frame{};
+  // The most recent request passed to `worker`.
+  std::optional<RenderRequest> last_request{};
+  // The neighbouring pages rendered ahead of time with the geometry they will be shown with.
+  std::unordered_map<int, Frame> ahead_frames{};
+  // The requests to render ahead of time that `worker` has not finished yet.
+  std::unordered_map<int, RenderRequest> ahead_requests{};
+  // Whether `render_ahead` is scheduled to be called when idle.
+  bool ahead_scheduled{false};
+  // Whether a page has been passed to `worker` to prewarm it that has not been rendered yet.
+  bool warming{false};
+  // Whether the zoom is changing, during which the current frame is scaled instead of re-rendered.
+  bool zooming{false};
+  // The timeout ending `zooming` once the zoom has not changed for `zoom_settle_ms`.
+  sigc::connection zoom_settle_conn{};
+  // The number of view updates since the last frame clock tick, which are merged into one render.
+  std::uint64_t dirty_updates{0};
+  // The ID of the tick callback handling the view updates, or 0 if there is none.
+  guint tick_id{0};
+  // The number of ticks with view updates and of the updates merged into the ticks.
+  std::uint64_t update_ticks{0};
+  std::uint64_t merged_updates{0};
+  RenderWorker worker;
+
+  explicit PdfViewer(Adw::Application& app, std::optional<std::filesystem::path> path = {},
+                     ViewerConfig cfg = {})
+      : config{cfg},
+#if ILLUMINATA_OPENGL
+        ogl{config.texture_budget, config.staging_budget},
+#endif
+        worker{[this](Frame f) { on_frame(std::move(f)); }, [this] { on_warmed(); },
+               config.tile_budget, config.pixmap_budget} {
     set_title("Illuminata");
     set_icon_name("org.kurbo96.Illuminata");
     set_default_size(800, 600);
@@ -82,7 +131,24 @@ struct PdfViewer : public Adw::ApplicationWindow {
       if (draw_area.has_error()) {
         return;
       }
-      ogl.realize();
+      ogl.realize(worker.staging());
+
+      // Upload the frames on the render worker thread in a context sharing its objects with that
+      // of the GLArea, so that drawing a frame only has to bind its texture. Without such a
+      // context, frames are uploaded when drawing them.
+      try {
+        auto upload_ctx = draw_area.get_native()->get_surface()->create_gl_context();
+        upload_ctx->set_allowed_apis(draw_area.get_context()->get_api());
+        upload_ctx->realize();
+        worker.set_finisher([this, upload_ctx](Frame& f) {
+          upload_ctx->make_current();
+          f.upload = ogl.uploader.upload(f, false);
+          Gdk::GLContext::clear_current();
+        });
+      } catch (const Glib::Error& err) {
+        fmt::print(stderr, "Cannot upload frames on the render thread: {}\n", err.what());
+      }
+      draw_area.make_current();
     });
 
     [[maybe_unused]] auto unrealize_conn = draw_area.signal_unrealize().connect(
@@ -91,6 +157,14 @@ struct PdfViewer : public Adw::ApplicationWindow {
         if (draw_area.has_error()) {
           return;
         }
+        // Drop all frames, which may have been rendered into staging buffers about to be deleted
+        // or uploaded, once the render worker does not upload frames anymore.
+        worker.set_finisher({});
+        worker.cancel();
+        frame.reset();
+        last_request.reset();
+        ahead_frames.clear();
+        ahead_requests.clear();
         ogl.unrealize();
       },
       false);
@@ -102,15 +176,35 @@ struct PdfViewer : public Adw::ApplicationWindow {
 
       const auto t0 = Clock::now();
       auto geom = compute_geom(draw_area.get_width(), draw_area.get_height());
+      auto& list = pdf->page_info->display_list;
+      // Usually a no-op, since view updates are requested on ticks, except after resizing.
+      if (!previewing(list) && !minifying(list, geom)) {
+        request_render(geom);
+      }
+      ogl.uploader.provide_staging(max_frame_bytes(geom));
       const auto t1 = Clock::now();
-      mupdf::FzPixmap pix = render(geom);
+      if (auto page = ogl.uploader.page_texture(list, geom.factor); page != nullptr) {
+        const auto place = placement(page->geom, geom);
+        ogl.draw_page(*page, geom.dims_scaled, place.offset, place.scale, invert);
+        log("page texture: {} → {}, setup={}, opengl={}\n", page->geom.factor, geom.factor,
+            Dur{t1 - t0}, Dur{Clock::now() - t1});
+        return true;
+      }
+      if (!frame.has_value()) {
+        ogl.clear();
+        return true;
+      }
+      auto& pix = frame->pix;
+      const auto place = frame->placement_in(geom, list);
+      ogl.draw(*frame, geom.dims_scaled, place.offset, place.scale, invert);
       const auto t2 = Clock::now();
-      ogl.draw(pix, geom.dims_scaled, geom.offset, invert);
-      const auto t3 = Clock::now();
 
       log("{} → {} → {} → {}×{} {}\n", geom.dims_base, geom.dims_scaled, geom.factor, pix.w(),
           pix.h(), pix.alpha());
-      log("setup={}, pixmap={}, opengl={}\n", Dur{t1 - t0}, Dur{t2 - t1}, Dur{t3 - t2});
+      log("setup={}, opengl={}\n", Dur{t1 - t0}, Dur{t2 - t1});
+      const TextureUsage usage = ogl.uploader.texture_usage();
+      log("textures: {} MiB in use, {} MiB cached, {} MiB budget\n", usage.used >> 20U,
+          usage.cached >> 20U, usage.budget >> 20U);
 
       return true;
     };
@@ -124,22 +218,37 @@ struct PdfViewer : public Adw::ApplicationWindow {
       const auto t0 = Clock::now();
 
       auto geom = compute_geom(width, height);
+      auto& list = pdf->page_info->display_list;
+      // Usually a no-op, since view updates are requested on ticks, except after resizing.
+      if (!previewing(list)) {
+        request_render(geom);
+      }
+      if (!frame.has_value()) {
+        return;
+      }
+      const auto place = frame->placement_in(geom, list);
       ctx->scale(1.0 / geom.scale, 1.0 / geom.scale);
+      ctx->translate(place.offset.x, place.offset.y);
+      ctx->scale(place.scale, place.scale);
       const auto t1 = Clock::now();
-      mupdf::FzPixmap pix = render(geom);
+      auto& pix = frame->pix;
+      if (pattern_frame != frame->id) {
+        // Frames have the memory layout of ARGB32, so Cairo can use their samples without copying.
+        auto surface = Cairo::ImageSurface::create(pix.samples(), Cairo::Surface::Format::ARGB32,
+                                                   pix.w(), pix.h(), int(pix.stride()));
+        frame_pattern = Cairo::SurfacePattern::create(surface);
+        pattern_frame = frame->id;
+      }
       const auto t2 = Clock::now();
-      auto pixbuf = Gdk::Pixbuf::create_from_data(
-        pix.samples(), Gdk::Colorspace::RGB, bool(pix.alpha()), 8, pix.w(), pix.h(), pix.stride());
+      ctx->set_source(frame_pattern);
       const auto t3 = Clock::now();
-      Gdk::Cairo::set_source_pixbuf(ctx, pixbuf, geom.offset.x, geom.offset.y);
-      const auto t4 = Clock::now();
       ctx->paint();
-      const auto t5 = Clock::now();
+      const auto t4 = Clock::now();
 
       log("{} → {} → {} → {}×{} {}\n", geom.dims_base, geom.dims_scaled, geom.factor, pix.w(),
           pix.h(), pix.alpha());
-      log("setup={}, pixmap={}, pixbuf={}, cairo={}, paint={}\n", Dur{t1 - t0}, Dur{t2 - t1},
-          Dur{t3 - t2}, Dur{t4 - t3}, Dur{t5 - t4});
+      log("setup={}, pattern={}, cairo={}, paint={}\n", Dur{t1 - t0}, Dur{t2 - t1}, Dur{t3 - t2},
+          Dur{t4 - t3});
     };
     draw_area.set_draw_func(draw_op);
 #endif
@@ -310,6 +419,8 @@ struct PdfViewer : public Adw::ApplicationWindow {
         // General
         case GDK_KEY_r: {
           if (pdf.has_value()) {
+            worker.cancel_warm();
+            warming = false;
             pdf->reload_doc();
             draw_area.queue_draw();
           }
@@ -376,40 +487,40 @@ struct PdfViewer : public Adw::ApplicationWindow {
         // On-Page Navigation
         case GDK_KEY_j: {
           transform.off.y -= is_shift ? 10.F : 1.F;
-          draw_area.queue_draw();
+          mark_dirty();
           return true;
         }
         case GDK_KEY_h: {
           transform.off.x -= is_shift ? 10.F : 1.F;
-          draw_area.queue_draw();
+          mark_dirty();
           return true;
         }
         case GDK_KEY_k: {
           transform.off.y += is_shift ? 10.F : 1.F;
-          draw_area.queue_draw();
+          mark_dirty();
           return true;
         }
         case GDK_KEY_l: {
           transform.off.x += is_shift ? 10.F : 1.F;
-          draw_area.queue_draw();
+          mark_dirty();
           return true;
         }
         case GDK_KEY_KP_Add:
         case GDK_KEY_plus: {
           transform.scale *= 1.1F;
-          draw_area.queue_draw();
+          zoom_changed();
           return true;
         }
         case GDK_KEY_KP_Subtract:
         case GDK_KEY_minus: {
           transform.scale *= 0.9F;
-          draw_area.queue_draw();
+          zoom_changed();
           return true;
         }
         case GDK_KEY_KP_0:
         case GDK_KEY_0: {
           transform.reset();
-          draw_area.queue_draw();
+          mark_dirty();
           return true;
         }
         default: break;
@@ -424,13 +535,15 @@ struct PdfViewer : public Adw::ApplicationWindow {
     [[maybe_unused]] auto drag_update_conn =
       drag->signal_drag_update().connect([this](double start_x, double start_y) {
         transform.drag_off = Vec2{float(start_x), float(start_y)};
-        draw_area.queue_draw();
+        mark_dirty();
       });
     [[maybe_unused]] auto drag_end_conn =
       drag->signal_drag_end().connect([this](double start_x, double start_y) {
         transform.off -= Vec2{float(start_x), float(start_y)} / doc_factor();
         transform.drag_off = {0.F};
-        draw_area.queue_draw();
+        // Render again so that the overscan is centered around the final view.
+        last_request.reset();
+        mark_dirty();
       });
     draw_area.add_controller(drag);
 
@@ -448,12 +561,12 @@ struct PdfViewer : public Adw::ApplicationWindow {
         case Gdk::ModifierType::NO_MODIFIER_MASK: {
           transform.off.x += (shift ? 1.F : 20.F) * float(dx);
           transform.off.y += (shift ? 1.F : 20.F) * float(dy);
-          draw_area.queue_draw();
+          mark_dirty();
           return true;
         }
         case Gdk::ModifierType::CONTROL_MASK: {
           transform.scale *= std::pow(1.F - (shift ? 0.02F : 0.1F), float(dy));
-          draw_area.queue_draw();
+          zoom_changed();
           return true;
         }
         default: break;
@@ -464,8 +577,11 @@ struct PdfViewer : public Adw::ApplicationWindow {
     draw_area.add_controller(scroll);
   }
 
+  static float doc_factor(Dims<float> dims, Rect<float> rect, const Transform& trans) {
+    return std::min(dims.w / rect.w(), dims.h / rect.h()) * trans.scale;
+  }
   float doc_factor(Dims<float> dims, Rect<float> rect) const {
-    return std::min(dims.w / rect.w(), dims.h / rect.h()) * transform.scale;
+    return doc_factor(dims, rect, transform);
   }
   float doc_factor() const {
     if (!pdf.has_value() || !pdf->page_info.has_value()) {
@@ -473,13 +589,43 @@ struct PdfViewer : public Adw::ApplicationWindow {
     }
 
     const Dims dims{draw_area.get_width(), draw_area.get_height()};
-    const Rect rect{pdf->page_info->page.fz_bound_page()};
+    const Rect rect = pdf->page_info->bounds;
     return doc_factor(Dims<float>(dims), rect);
   }
 
+  // Called on the main thread with each frame finished by `worker`.
+  void on_frame(Frame f) {
+    // Rendered into a staging buffer that has been revoked since.
+    if (!f.valid()) {
+      return;
+    }
+    if (f.ahead) {
+      log("rendered page {} ahead\n", f.page);
+      if (auto it = ahead_requests.find(f.page);
+          it != ahead_requests.end() && f.same_raster(it->second)) {
+        ahead_requests.erase(it);
+      }
+      ahead_frames.insert_or_assign(f.page, std::move(f));
+      return;
+    }
+    // Superseded by the last request, e.g. a render of the previous page that was already being
+    // finished when the worker was cancelled to show a page rendered ahead.
+    if (!last_request.has_value() || !f.same_raster(*last_request)) {
+      log("drop superseded frame {} of page {}\n", f.id, f.page);
+      return;
+    }
+    frame.emplace(std::move(f));
+    draw_area.queue_draw();
+    schedule_render_ahead();
+  }
+
   void load_pdf(std::filesystem::path p) {
     set_title(fmt::format("Illuminata: {}", p.filename()));
-    pdf.emplace(std::move(p));
+    ahead_frames.clear();
+    ahead_requests.clear();
+    worker.cancel_warm();
+    warming = false;
+    pdf.emplace(std::move(p), 0, config.prefetch, [this] { schedule_render_ahead(); });
     draw_area.queue_draw();
   }
 
@@ -488,21 +634,26 @@ struct PdfViewer : public Adw::ApplicationWindow {
       const auto new_page = pdf->page + direction;
       if (pdf->valid_page(new_page)) {
         pdf->update_page(new_page);
-        draw_area.queue_draw();
+        mark_dirty();
       }
     }
   }
 
   GeomInfo compute_geom(int width, int height) const {
+    return compute_geom(width, height, pdf->page_info->bounds, transform);
+  }
+  // The geometry of a page with bounds `rect` shown with the transform `view`.
+  GeomInfo compute_geom(int width, int height, Rect<float> rect, const Transform& view) const {
     const Dims dims_base{width, height};
     const auto scale = draw_area.get_scale_factor();
 
-    const Rect rect{pdf->page_info->page.fz_bound_page()};
-    const auto f_base = doc_factor(Dims<float>(dims_base), rect);
-    const auto f_scaled = f_base * float(scale);
+    // Quantize the scaling factor to a zoom level so that cached tiles can be reused.
+    const auto f_scaled =
+      quantize_factor(doc_factor(Dims<float>(dims_base), rect, view) * float(scale));
+    const auto f_base = f_scaled / float(scale);
 
     const auto mat = mupdf::FzMatrix{}.fz_pre_scale(f_scaled, f_scaled);
-    const auto trans = transform.document_transform(dims_base, rect, f_base, f_scaled);
+    const auto trans = view.document_transform(dims_base, rect, f_base, f_scaled);
     mupdf::FzRect rclip = trans.rclip.fz_rect();
 
     return GeomInfo{
@@ -514,19 +665,208 @@ struct PdfViewer : public Adw::ApplicationWindow {
       .offset = trans.offset,
       .rclip = rclip,
       .irect = rclip.fz_transform_rect(mat).fz_round_rect(),
+      .bounds = rect.fz_rect(),
+    };
+  }
+
+  // An upper bound for the size of the frames rendered for views with the dimensions of `geom`.
+  static std::size_t max_frame_bytes(const GeomInfo& geom) {
+    return std::size_t(geom.dims_scaled.w + 2 * overscan) *
+           std::size_t(geom.dims_scaled.h + 2 * overscan) * frame_components;
+  }
+
+  // Whether to show a preview of the page with display list `list` by scaling the current frame
+  // rather than requesting a render, which is the case while zooming if there is a frame of it.
+  bool previewing(const mupdf::FzDisplayList& list) const {
+    return zooming && frame.has_value() && frame->display_list.m_internal == list.m_internal;
+  }
+
+  // Whether to show the view with geometry `geom` of the page with display list `list` by
+  // minifying the mipmapped page texture rather than rendering it, which is the case if the page
+  // texture has at least the detail needed. Since the page texture is only kept with OpenGL,
+  // this is never the case with Cairo.
+  bool minifying([[maybe_unused]] const mupdf::FzDisplayList& list,
+                 [[maybe_unused]] const GeomInfo& geom) const {
+#if ILLUMINATA_OPENGL
+    return ogl.uploader.page_texture(list, geom.factor) != nullptr;
+#else
+    return false;
+#endif
+  }
+
+  // Show the new zoom level by scaling the current frame until the zoom has settled.
+  void zoom_changed() {
+    zooming = true;
+    zoom_settle_conn.disconnect();
+    zoom_settle_conn = Glib::signal_timeout().connect(
+      sigc::mem_fun(*this, &PdfViewer::zoom_settled), zoom_settle_ms);
+    mark_dirty();
+  }
+  // Render the page sharply at the zoom level it has settled at.
+  bool zoom_settled() {
+    zooming = false;
+    mark_dirty();
+    return false;
+  }
+
+  // Note that the view has been updated, which is handled at the next frame clock tick.
+  // Input events can arrive much faster than frames are rendered, e.g. from high-resolution
+  // touchpads, so they only update `transform` and all updates between two ticks result
+  // in a single render request with the latest state.
+  void mark_dirty() {
+    ++dirty_updates;
+    if (tick_id == 0) {
+      tick_id = draw_area.add_tick_callback(sigc::mem_fun(*this, &PdfViewer::on_tick));
+    }
+  }
+  bool on_tick(const Glib::RefPtr<Gdk::FrameClock>& /*clock*/) {
+    tick_id = 0;
+    ++update_ticks;
+    merged_updates += dirty_updates - 1;
+    log("tick: {} updates, {} merged into {} ticks in total\n", dirty_updates, merged_updates,
+        update_ticks);
+    dirty_updates = 0;
+
+    if (pdf.has_value() && pdf->page_info.has_value() &&
+        !previewing(pdf->page_info->display_list)) {
+      const GeomInfo geom = compute_geom(draw_area.get_width(), draw_area.get_height());
+      if (!minifying(pdf->page_info->display_list, geom)) {
+        request_render(geom);
+      }
+    }
+    draw_area.queue_draw();
+    // Remove the callback until the view is updated again.
+    return false;
+  }
+
+  // Pass the current page with geometry `geom` and an overscan margin to the render worker unless
+  // the most recent request or the frame shown already covers the visible area.
+  // Resetting `last_request`, e.g. when a drag ends, forces a new render.
+  void request_render(const GeomInfo& geom) {
+    auto& list = pdf->page_info->display_list;
+    if (last_request.has_value() && last_request->display_list.m_internal == list.m_internal &&
+        last_request->geom.covers(geom)) {
+      return;
+    }
+    // The frame shown covers the view, e.g. after panning back while another render is in progress.
+    // Keep showing it instead of rendering it again. The render in progress may still be delivered
+    // if it is already being finished, which `on_frame` drops since it does not match the request.
+    if (last_request.has_value() && frame.has_value() &&
+        frame->display_list.m_internal == list.m_internal && frame->geom.covers(geom)) {
+      log("reuse frame {} of page {}\n", frame->id, frame->page);
+      last_request.emplace(RenderRequest{
+        .page = frame->page,
+        .display_list = frame->display_list,
+        .geom = frame->geom,
+      });
+      worker.cancel();
+      ahead_requests.clear();
+      schedule_render_ahead();
+      return;
+    }
+    RenderRequest req{
+      .page = pdf->page,
+      .display_list = list,
+      .geom = geom.with_overscan(overscan),
     };
+    last_request.emplace(req);
+
+    if (auto it = ahead_frames.find(req.page);
+        it != ahead_frames.end() &&
+        it->second.display_list.m_internal == list.m_internal && it->second.geom.covers(geom)) {
+      log("show page {} rendered ahead\n", req.page);
+      last_request->geom = it->second.geom;
+      frame.emplace(std::move(it->second));
+      ahead_frames.erase(it);
+      worker.cancel();
+      ahead_requests.clear();
+      schedule_render_ahead();
+      return;
+    }
+    worker.request(std::move(req));
+    ahead_requests.clear();
+  }
+
+  // Call `render_ahead` once the main loop is idle, unless the current page is still rendering.
+  void schedule_render_ahead() {
+    const bool current = frame.has_value() && last_request.has_value() &&
+                         frame->same_raster(*last_request);
+    if (ahead_scheduled || !current) {
+      return;
+    }
+    ahead_scheduled = true;
+    Glib::signal_idle().connect_once(sigc::mem_fun(*this, &PdfViewer::render_ahead));
   }
 
-  mupdf::FzPixmap render(GeomInfo& geom) {
-    mupdf::FzPixmap pix{mupdf::FzColorspace::Fixed_RGB, geom.irect, mupdf::FzSeparations{}, 0};
-    pix.fz_clear_pixmap_with_value(0xFF);
+  // Render the next and previous page with the geometry they are shown with after navigating,
+  // i.e. with the current view dimensions and the default transform.
+  // Frames rendered ahead of time with a different geometry are dropped, which invalidates them
+  // when the window is resized or its scale factor changes.
+  void render_ahead() {
+    ahead_scheduled = false;
+    if (!pdf.has_value() || !pdf->page_info.has_value()) {
+      return;
+    }
 
-    mupdf::FzDevice dev{geom.fzmat, pix, geom.irect};
-    mupdf::FzCookie cookie{};
-    pdf->page_info->display_list.fz_run_display_list(dev, mupdf::FzMatrix{}, geom.rclip, cookie);
-    dev.fz_close_device();
+    const int width = draw_area.get_width();
+    const int height = draw_area.get_height();
+    std::unordered_map<int, Frame> kept{};
+    std::vector<RenderRequest> reqs{};
+    for (const int pno : {pdf->page + 1, pdf->page - 1}) {
+      auto page = pdf->pages->find(pno);
+      if (!page.has_value()) {
+        continue;
+      }
+      RenderRequest req{
+        .page = pno,
+        .display_list = std::move(page->display_list),
+        .geom = compute_geom(width, height, page->bounds, Transform{}).with_overscan(overscan),
+        .ahead = true,
+      };
+      if (auto it = ahead_frames.find(pno);
+          it != ahead_frames.end() && it->second.same_raster(req)) {
+        kept.insert(ahead_frames.extract(it));
+        continue;
+      }
+      if (auto it = ahead_requests.find(pno);
+          it != ahead_requests.end() && it->second.same_raster(req)) {
+        continue;
+      }
+      ahead_requests.insert_or_assign(pno, req);
+      reqs.push_back(std::move(req));
+    }
+    ahead_frames = std::move(kept);
+    worker.request_ahead(std::move(reqs));
+    prewarm();
+  }
+
+  // Pass the next page to prewarm to `worker`, if the page cache has loaded it, with the geometry
+  // it is shown with after navigating, so that its images are decoded and its glyphs are rendered
+  // at the resolution they are shown at. Only one page is passed at a time, so that the page cache
+  // only loads the next page meanwhile and the pages of a closed document are not rendered.
+  void prewarm() {
+    const int width = draw_area.get_width();
+    const int height = draw_area.get_height();
+    if (warming || width <= 0 || height <= 0) {
+      return;
+    }
+    auto page = pdf->pages->take_warm();
+    if (!page.has_value()) {
+      return;
+    }
+    auto& [pno, display] = *page;
+    worker.request_warm(RenderRequest{
+      .page = pno,
+      .display_list = std::move(display.display_list),
+      .geom = compute_geom(width, height, display.bounds, Transform{}),
+    });
+    warming = true;
+  }
 
-    return pix;
+  // Called on the main thread once `worker` has prewarmed the pages passed to it.
+  void on_warmed() {
+    warming = false;
+    schedule_render_ahead();
   }
 };
 } // namespace illa
@@ -0,0 +1,402 @@
+#ifndef INCLUDE_ILLUMINATA_PDF_WORKER_HPP
+#define INCLUDE_ILLUMINATA_PDF_WORKER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <glibmm.h>
+
+#include "illuminata/fmt.hpp"
+#include "illuminata/geometry.hpp"
+#include "illuminata/log.hpp"
+#include "illuminata/mupdf.hpp"
+#include "illuminata/pdf/pixmaps.hpp"
+#include "illuminata/pdf/render.hpp"
+#include "illuminata/pdf/staging.hpp"
+#include "illuminata/pdf/tiles.hpp"
+#include "illuminata/queue.hpp"
+#include "illuminata/threads.hpp"
+
+namespace illa {
+// A request to render the given part of a page.
+struct RenderRequest {
+  int page;
+  mupdf::FzDisplayList display_list;
+  GeomInfo geom;
+  // Whether the page is rendered ahead of time rather than for the current view.
+  bool ahead{false};
+
+  // Whether this request results in the same pixmap as `other`.
+  [[nodiscard]] bool same_raster(const RenderRequest& other) const {
+    return display_list.m_internal == other.display_list.m_internal &&
+           geom.same_raster(other.geom);
+  }
+};
+
+// Where a frame is shown in a view.
+struct Placement {
+  // The offset of the upper left corner of the frame in the view (scaled view coordinates).
+  Vec2<float> offset;
+  // The factor by which the frame is scaled.
+  float scale;
+};
+
+// The placement of a raster rendered with geometry `raster` in the view `view` of the same page,
+// which is scaled if the view has a different zoom level.
+inline Placement placement(const GeomInfo& raster, const GeomInfo& view) {
+  const float scale = view.factor / raster.factor;
+  // The position of the pixel origin of the view.
+  const Vec2<float> origin = view.offset - Vec2{float(view.irect.x0), float(view.irect.y0)};
+  return {
+    .offset = origin + Vec2{float(raster.irect.x0), float(raster.irect.y0)} * scale,
+    .scale = scale,
+  };
+}
+
+// The frame as uploaded to the GPU, see `FrameUploader` (only with OpenGL).
+struct FrameUpload;
+
+// A rendered part of a page together with the geometry it has been rendered with.
+struct Frame {
+  // A number identifying the frame, which is unique for each render worker.
+  std::uint64_t id;
+  int page;
+  mupdf::FzDisplayList display_list;
+  GeomInfo geom;
+  // The staging buffer holding the samples of `pix`, if any.
+  // Declared before `pix` so that the buffer is returned after the pixmap is dropped.
+  std::shared_ptr<StagingLease> staging;
+  // The buffer from the pixmap pool of the worker holding the samples of `pix` otherwise.
+  // Declared before `pix` so that the buffer is returned after the pixmap is dropped.
+  std::shared_ptr<unsigned char[]> samples{};
+  mupdf::FzPixmap pix;
+  // Whether the page has been rendered ahead of time rather than for the current view.
+  bool ahead{false};
+  // The upload of the frame to the GPU, if it has been uploaded.
+  std::shared_ptr<FrameUpload> upload{};
+
+  // Whether the samples of the frame can be accessed, which is not the case if its staging buffer
+  // has been revoked.
+  [[nodiscard]] bool valid() const {
+    return staging == nullptr || staging->valid();
+  }
+
+  // Whether this frame is the result of rendering `req`.
+  [[nodiscard]] bool same_raster(const RenderRequest& req) const {
+    return display_list.m_internal == req.display_list.m_internal && geom.same_raster(req.geom);
+  }
+
+  // The placement of the frame in the view `view` of the page with display list `list`.
+  // If the view shows the same page at a different zoom level, the frame is scaled accordingly,
+  // while frames of other pages are shown at their original position.
+  [[nodiscard]] Placement placement_in(const GeomInfo& view,
+                                       const mupdf::FzDisplayList& list) const {
+    if (list.m_internal != display_list.m_internal) {
+      return {.offset = geom.offset, .scale = 1.F};
+    }
+    return placement(geom, view);
+  }
+};
+
+// Renders pages on a dedicated thread so that rasterization never blocks the GTK main loop.
+// Requests have three priority classes: Only the most recent request for the current view is
+// rendered, and a new one preempts the render in progress, whichever class it has, by aborting its
+// cookie. Requests to render ahead of time are only handled while there is no request for the
+// view, and are dropped when one arrives, since they are based on an outdated state.
+// Requests to prewarm pages are only handled while there is nothing else to render and preempted
+// by any other request, after which they are rendered again. Their rasters are dropped, which only
+// leaves the decoded images and rendered glyphs in the caches of MuPDF, and `on_warmed` is called
+// on the main thread once all of them have been rendered.
+// Frames for the current view are composed from the tiles in `tiles_`, of which only the missing
+// ones are rasterized, while frames rendered ahead of time are rasterized in parallel bands.
+// Both use `pool_`, in which the worker thread takes part. Frames are rendered into the buffers
+// provided to `staging()` if there is a large enough one, e.g. memory mapped for texture uploads,
+// and otherwise into buffers from `pixmaps_`, like the tiles, so that rendering does not allocate
+// once the buffers have been recycled.
+// Finished frames are passed to the finisher on the worker thread, if there is one, e.g. to upload
+// them to the GPU, and are handed back to the main loop through a lock-free queue drained by a
+// `Glib::Dispatcher`, which calls `on_frame` on the main thread.
+struct RenderWorker {
+  using Clock = std::chrono::steady_clock;
+  using Dur = std::chrono::duration<double>;
+
+  // The default memory budget of the tile cache (in bytes).
+  static constexpr std::size_t default_tile_budget = std::size_t{256} << 20U;
+
+  RenderWorker(std::function<void(Frame)> on_frame, std::function<void()> on_warmed,
+               std::size_t tile_budget = default_tile_budget,
+               std::size_t pixmap_budget = PixmapPool::default_budget)
+      : on_frame_{std::move(on_frame)}, pixmaps_{pixmap_budget}, tiles_{tile_budget} {
+    dispatcher_.connect([this] { deliver(); });
+    warm_dispatcher_.connect(std::move(on_warmed));
+    thread_ = std::jthread{[this](std::stop_token stoken) { run(stoken); }};
+  }
+  RenderWorker(const RenderWorker&) = delete;
+  RenderWorker(RenderWorker&&) = delete;
+  RenderWorker& operator=(const RenderWorker&) = delete;
+  RenderWorker& operator=(RenderWorker&&) = delete;
+  // Aborts the render in progress, so that destroying the worker does not wait for it to finish.
+  ~RenderWorker() {
+    std::scoped_lock lock{mutex_};
+    pending_.reset();
+    ahead_.clear();
+    warm_.clear();
+    ++warm_generation_;
+    abort();
+  }
+
+  // Replace the pending request, if there is one, by `req` and abort the render in progress.
+  // The requests to render ahead of time are dropped, since they are based on an outdated state.
+  void request(RenderRequest req) {
+    {
+      std::scoped_lock lock{mutex_};
+      pending_.emplace(std::move(req));
+      ahead_.clear();
+      abort();
+    }
+    cv_.notify_one();
+  }
+
+  // Add `reqs` to the requests to render ahead of time, preempting a page being prewarmed.
+  void request_ahead(std::vector<RenderRequest> reqs) {
+    {
+      std::scoped_lock lock{mutex_};
+      ahead_.insert(ahead_.end(), std::make_move_iterator(reqs.begin()),
+                    std::make_move_iterator(reqs.end()));
+      if (warming_) {
+        abort();
+      }
+    }
+    cv_.notify_one();
+  }
+
+  // Add `req` to the requests to prewarm pages.
+  void request_warm(RenderRequest req) {
+    {
+      std::scoped_lock lock{mutex_};
+      warm_.push_back(std::move(req));
+    }
+    cv_.notify_one();
+  }
+
+  // Drop the requests to prewarm pages and abort prewarming the page in progress,
+  // e.g. since they belong to a document that has been closed.
+  void cancel_warm() {
+    std::scoped_lock lock{mutex_};
+    warm_.clear();
+    ++warm_generation_;
+    if (warming_) {
+      abort();
+    }
+  }
+
+  // Drop all pending requests except those to prewarm pages as well as all undelivered frames and
+  // abort the render in progress.
+  // A render that is already past its last abort check is still delivered afterwards.
+  // Only called on the main thread.
+  void cancel() {
+    {
+      std::scoped_lock lock{mutex_};
+      pending_.reset();
+      ahead_.clear();
+      abort();
+    }
+    [[maybe_unused]] std::vector<Frame> dropped = finished_.take_all();
+  }
+
+  // Call `finisher` with each finished frame on the worker thread before it is delivered,
+  // or stop doing so if it is empty. Blocks until the previous finisher has returned.
+  void set_finisher(std::function<void(Frame&)> finisher) {
+    std::scoped_lock lock{finisher_mutex_};
+    finisher_ = std::move(finisher);
+  }
+
+  StagingPool& staging() {
+    return staging_;
+  }
+
+private:
+  // Requires holding `mutex_`.
+  void abort() {
+    if (cookie_ != nullptr) {
+      cookie_->abort();
+    }
+  }
+
+  void run(std::stop_token stoken) {
+    while (true) {
+      std::optional<RenderRequest> req{};
+      RenderCookie cookie{};
+      bool warm = false;
+      std::uint64_t warm_generation{};
+      {
+        std::unique_lock lock{mutex_};
+        if (!cv_.wait(lock, stoken, [&] {
+              return pending_.has_value() || !ahead_.empty() || !warm_.empty();
+            })) {
+          return;
+        }
+        if (pending_.has_value()) {
+          req.swap(pending_);
+        } else if (!ahead_.empty()) {
+          req.emplace(std::move(ahead_.front()));
+          ahead_.pop_front();
+        } else {
+          req.emplace(std::move(warm_.front()));
+          warm_.pop_front();
+          warm = true;
+          warming_ = true;
+          warm_generation = warm_generation_;
+        }
+        // Published while taking the request so that no later request can miss it.
+        cookie_ = &cookie;
+      }
+
+      if (warm) {
+        prewarm(std::move(*req), cookie, warm_generation);
+        continue;
+      }
+
+      try {
+        const auto t0 = Clock::now();
+        const std::size_t allocs0 = pixmaps_.stats().allocations;
+        const std::size_t bytes = frame_bytes(req->geom.irect);
+        std::shared_ptr<StagingLease> lease = staging_.acquire(bytes);
+        std::shared_ptr<unsigned char[]> samples =
+          lease != nullptr ? nullptr : pixmaps_.acquire(bytes);
+        mupdf::FzPixmap pix = new_frame_pixmap(
+          req->geom.irect, lease != nullptr ? lease->buffer().data : samples.get());
+        if (req->ahead) {
+          render(req->display_list, req->geom, pix, cookie, pool_);
+        } else {
+          tiles_.render(req->display_list, req->geom, pix, cookie, pool_, pixmaps_);
+        }
+        const std::size_t allocs = pixmaps_.stats().allocations - allocs0;
+        if (lease != nullptr) {
+          lease->finish();
+        }
+        const auto t1 = Clock::now();
+
+        {
+          std::scoped_lock lock{mutex_};
+          cookie_ = nullptr;
+        }
+        if (cookie.aborted()) {
+          log("abort page {}: {}×{} after {}\n", req->page, pix.w(), pix.h(), Dur{t1 - t0});
+          continue;
+        }
+        log("render page {}: {}×{} in {}, {} pixmap allocations\n", req->page, pix.w(), pix.h(),
+            Dur{t1 - t0}, allocs);
+        Frame frame{
+          .id = next_id_++,
+          .page = req->page,
+          .display_list = std::move(req->display_list),
+          .geom = req->geom,
+          .staging = std::move(lease),
+          .samples = std::move(samples),
+          .pix = std::move(pix),
+          .ahead = req->ahead,
+        };
+        {
+          std::scoped_lock lock{finisher_mutex_};
+          if (finisher_) {
+            finisher_(frame);
+            log("finish page {} in {}\n", frame.page, Dur{Clock::now() - t1});
+          }
+        }
+        finished_.push(std::move(frame));
+        dispatcher_.emit();
+      } catch (const std::exception& ex) {
+        {
+          std::scoped_lock lock{mutex_};
+          cookie_ = nullptr;
+        }
+        fmt::print(stderr, "Rendering page {} failed: {}\n", req->page, ex.what());
+      }
+    }
+  }
+
+  // Render `req` into a buffer from `pixmaps_` and drop the raster. If the render is preempted,
+  // `req` is requeued unless the requests to prewarm pages have been cancelled since they were
+  // from generation `generation`.
+  void prewarm(RenderRequest req, RenderCookie& cookie, std::uint64_t generation) {
+    bool done = false;
+    try {
+      const auto t0 = Clock::now();
+      PooledPixmap pix = pixmaps_.new_pixmap(req.geom.irect);
+      render(req.display_list, req.geom, pix.pix, cookie, pool_);
+      if (!cookie.aborted()) {
+        log("prewarm page {}: {}×{} in {}\n", req.page, pix.pix.w(), pix.pix.h(),
+            Dur{Clock::now() - t0});
+      }
+    } catch (const std::exception& ex) {
+      fmt::print(stderr, "Prewarming page {} failed: {}\n", req.page, ex.what());
+    }
+    {
+      std::scoped_lock lock{mutex_};
+      cookie_ = nullptr;
+      warming_ = false;
+      if (cookie.aborted() && generation == warm_generation_) {
+        warm_.push_front(std::move(req));
+      }
+      done = warm_.empty() && generation == warm_generation_;
+    }
+    if (done) {
+      warm_dispatcher_.emit();
+    }
+  }
+
+  // Called on the main thread whenever a frame has been finished.
+  void deliver() {
+    for (Frame& frame : finished_.take_all()) {
+      on_frame_(std::move(frame));
+    }
+  }
+
+  std::function<void(Frame)> on_frame_;
+  ThreadPool pool_{};
+  PixmapPool pixmaps_;
+  // Only used on the worker thread.
+  TileCache tiles_;
+  StagingPool staging_{};
+  std::uint64_t next_id_{0};
+  Glib::Dispatcher dispatcher_{};
+  Glib::Dispatcher warm_dispatcher_{};
+  std::mutex mutex_{};
+  std::condition_variable_any cv_{};
+  // The request to render next (guarded by `mutex_`).
+  std::optional<RenderRequest> pending_{};
+  // The requests to render ahead of time, in order (guarded by `mutex_`).
+  std::deque<RenderRequest> ahead_{};
+  // The requests to prewarm pages, in order (guarded by `mutex_`).
+  std::deque<RenderRequest> warm_{};
+  // Incremented whenever the requests to prewarm pages are cancelled (guarded by `mutex_`).
+  std::uint64_t warm_generation_{0};
+  // Whether the render in progress prewarms a page (guarded by `mutex_`).
+  bool warming_{false};
+  // The cookie of the render in progress, if there is one (guarded by `mutex_`).
+  RenderCookie* cookie_{};
+  // The finished frames not yet delivered, which are only taken on the main thread.
+  MpscQueue<Frame> finished_{};
+  // Guards `finisher_`, which is held while calling it.
+  std::mutex finisher_mutex_{};
+  std::function<void(Frame&)> finisher_{};
+  // Declared last so that the thread is stopped before the other members are destroyed.
+  std::jthread thread_{};
+};
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_PDF_WORKER_HPP
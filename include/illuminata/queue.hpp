@@ -0,0 +1,66 @@
+#ifndef INCLUDE_ILLUMINATA_QUEUE_HPP
+#define INCLUDE_ILLUMINATA_QUEUE_HPP
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+namespace illa {
+// A queue into which any number of threads push values without taking a lock, and from which
+// a single thread takes all values at once, in the order in which they have been pushed.
+// Pushing only allocates a node and swings the head with a compare-and-swap, so producers never
+// wait for the consumer, e.g. a render thread for the main loop.
+template<typename T>
+struct MpscQueue {
+  MpscQueue() = default;
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue(MpscQueue&&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+  MpscQueue& operator=(MpscQueue&&) = delete;
+  ~MpscQueue() {
+    drop(head_.exchange(nullptr, std::memory_order_acquire));
+  }
+
+  void push(T value) {
+    auto* node = new Node{.value = std::move(value), .next = head_.load(std::memory_order_relaxed)};
+    while (!head_.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+    }
+  }
+
+  // Take all values pushed so far, oldest first. Only to be called by one thread at a time.
+  [[nodiscard]] std::vector<T> take_all() {
+    // The nodes form a stack, most recently pushed first, which is reversed.
+    Node* node = head_.exchange(nullptr, std::memory_order_acquire);
+    Node* oldest = nullptr;
+    while (node != nullptr) {
+      Node* next = node->next;
+      node->next = oldest;
+      oldest = node;
+      node = next;
+    }
+    std::vector<T> out{};
+    for (Node* it = oldest; it != nullptr; it = it->next) {
+      out.push_back(std::move(it->value));
+    }
+    drop(oldest);
+    return out;
+  }
+
+private:
+  struct Node {
+    T value;
+    Node* next;
+  };
+
+  static void drop(Node* node) {
+    while (node != nullptr) {
+      delete std::exchange(node, node->next);
+    }
+  }
+
+  std::atomic<Node*> head_{nullptr};
+};
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_QUEUE_HPP
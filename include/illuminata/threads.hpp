@@ -0,0 +1,155 @@
+#ifndef INCLUDE_ILLUMINATA_THREADS_HPP
+#define INCLUDE_ILLUMINATA_THREADS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <latch>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace illa {
+// A fixed set of threads on which loop iterations are run in parallel.
+// The thread calling `parallel_for` takes part in the work, so a pool with `size()` threads
+// in total only starts `size() - 1` threads.
+// Each thread has its own queue, into which the iterations are spread in contiguous blocks,
+// so that the threads mostly take neighbouring iterations from their own queues without
+// contending on a shared one. A thread whose queue is empty steals iterations from the back of
+// the other queues, so that threads finishing early help with the remaining work.
+struct ThreadPool {
+  explicit ThreadPool(std::size_t size = std::thread::hardware_concurrency())
+      : queues_(std::max<std::size_t>(size, 1)) {
+    const std::size_t helpers = queues_.size() - 1;
+    threads_.reserve(helpers);
+    for (std::size_t i = 1; i <= helpers; ++i) {
+      threads_.emplace_back([this, i](std::stop_token stoken) { run(stoken, i); });
+    }
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool(ThreadPool&&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ThreadPool& operator=(ThreadPool&&) = delete;
+  ~ThreadPool() = default;
+
+  // The number of threads working on a `parallel_for`, including the calling thread.
+  [[nodiscard]] std::size_t size() const {
+    return threads_.size() + 1;
+  }
+
+  // Call `fun(i)` for all `i` in [0, n) in parallel and wait for all calls to finish.
+  // If any call throws an exception, the first one is rethrown once all calls have finished.
+  template<typename TFun>
+  void parallel_for(std::size_t n, TFun&& fun) {
+    if (n == 0) {
+      return;
+    }
+
+    std::latch done{static_cast<std::ptrdiff_t>(n)};
+    std::mutex error_mutex{};
+    std::exception_ptr error{};
+    auto call = [&](std::size_t i) {
+      try {
+        fun(i);
+      } catch (...) {
+        std::scoped_lock lock{error_mutex};
+        if (error == nullptr) {
+          error = std::current_exception();
+        }
+      }
+      done.count_down();
+    };
+
+    // Counted before the tasks are pushed so that the count never becomes negative.
+    {
+      std::scoped_lock lock{sleep_mutex_};
+      queued_ += static_cast<std::ptrdiff_t>(n);
+    }
+    const std::size_t k = queues_.size();
+    for (std::size_t q = 0; q < k; ++q) {
+      Queue& queue = queues_[q];
+      std::scoped_lock lock{queue.mutex};
+      for (std::size_t i = n * q / k; i < n * (q + 1) / k; ++i) {
+        queue.tasks.emplace_back([&call, i] { call(i); });
+      }
+    }
+    cv_.notify_all();
+
+    // The calling thread works on the first block and then helps with the remaining iterations
+    // instead of waiting idly.
+    while (auto task = take(0)) {
+      (*task)();
+    }
+    done.wait();
+
+    if (error != nullptr) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  using Task = std::function<void()>;
+
+  struct Queue {
+    std::mutex mutex{};
+    std::deque<Task> tasks{};
+  };
+
+  // The next task for the thread with queue `own`, which is taken from the front of its queue if
+  // it is not empty and stolen from the back of another queue otherwise.
+  std::optional<Task> take(std::size_t own) {
+    const std::size_t k = queues_.size();
+    for (std::size_t j = 0; j < k; ++j) {
+      Queue& queue = queues_[(own + j) % k];
+      std::scoped_lock lock{queue.mutex};
+      if (queue.tasks.empty()) {
+        continue;
+      }
+      Task task{};
+      if (j == 0) {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      } else {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+      }
+      --queued_;
+      return task;
+    }
+    return std::nullopt;
+  }
+
+  void run(std::stop_token stoken, std::size_t own) {
+    while (true) {
+      {
+        std::unique_lock lock{sleep_mutex_};
+        if (!cv_.wait(lock, stoken, [&] { return queued_ > 0; })) {
+          return;
+        }
+      }
+      while (auto task = take(own)) {
+        (*task)();
+      }
+    }
+  }
+
+  // One queue per thread, where the calling thread of `parallel_for` uses the first one.
+  std::vector<Queue> queues_;
+  // The number of queued tasks, which the threads wait for to become positive.
+  // Incremented while holding `sleep_mutex_` so that no wakeup is missed.
+  std::atomic<std::ptrdiff_t> queued_{0};
+  std::mutex sleep_mutex_{};
+  std::condition_variable_any cv_{};
+  // Declared last so that the threads are stopped before the other members are destroyed.
+  std::vector<std::jthread> threads_{};
+};
+} // namespace illa
+
+#endif // INCLUDE_ILLUMINATA_THREADS_HPP
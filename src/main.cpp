@@ -1,17 +1,80 @@
+#include <charconv>
+#include <cstddef>
 #include <filesystem>
+#include <limits>
 #include <optional>
+#include <stdexcept>
+#include <string_view>
 
 #include <giomm.h>
 #include <libadwaitamm.h>
 
 #include "illuminata/illuminata.hpp"
 
+namespace {
+constexpr std::string_view usage =
+  "Usage: {} [options] [PDF Path]\n"
+  "  --tile-cache=MIB     memory budget of the rendered tiles\n"
+  "  --pixmap-cache=MIB   memory budget of the sample buffers kept for reuse\n"
+#if ILLUMINATA_OPENGL
+  "  --texture-cache=MIB  memory budget of the textures\n"
+  "  --staging-cache=MIB  memory budget of the buffers frames are rendered into for uploading\n"
+#endif
+  "  --prewarm            render all pages once in the background after opening a document\n";
+
+// The budget given as the value of option `name` in `arg` (in MiB), if `arg` is that option.
+// Throws `std::invalid_argument` if the value is not a positive number of MiB that fits in bytes.
+std::optional<std::size_t> parse_budget(std::string_view arg, std::string_view name) {
+  if (!arg.starts_with(name) || arg.substr(name.size(), 1) != "=") {
+    return std::nullopt;
+  }
+  const std::string_view value = arg.substr(name.size() + 1);
+  std::size_t mib{};
+  const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), mib);
+  if (ec != std::errc{} || end != value.data() + value.size() || mib == 0 ||
+      mib > (std::numeric_limits<std::size_t>::max() >> 20U)) {
+    throw std::invalid_argument{fmt::format("Invalid budget for {}: {}", name, value)};
+  }
+  return mib << 20U;
+}
+} // namespace
+
 int main(int argc, char* argv[]) {
-  if (argc > 2) {
-    fmt::print(stderr, "Usage: {} [PDF Path]", argv[0]);
+  illa::ViewerConfig config{};
+  std::optional<std::filesystem::path> path{};
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const std::string_view arg{argv[i]};
+      if (auto budget = parse_budget(arg, "--tile-cache")) {
+        config.tile_budget = *budget;
+      } else if (auto budget = parse_budget(arg, "--pixmap-cache")) {
+        config.pixmap_budget = *budget;
+#if ILLUMINATA_OPENGL
+      } else if (auto budget = parse_budget(arg, "--texture-cache")) {
+        config.texture_budget = *budget;
+      } else if (auto budget = parse_budget(arg, "--staging-cache")) {
+        config.staging_budget = *budget;
+#endif
+      } else if (arg == "--prewarm") {
+        config.prefetch.prewarm = true;
+      } else if (!arg.starts_with("--") && !path.has_value()) {
+        path.emplace(arg);
+      } else {
+        fmt::print(stderr, fmt::runtime(usage), argv[0]);
+        return 1;
+      }
+    }
+  } catch (const std::invalid_argument& ex) {
+    fmt::print(stderr, "{}\n", ex.what());
+    return 1;
+  }
+
+  if (!illa::thread_contexts()) {
+    fmt::print(stderr, "MuPDF shares one context between all threads, which Illuminata cannot "
+                       "render with. Is MUPDF_mt_ctx set to 0?\n");
+    return 1;
   }
-  auto path = (argc > 1) ? std::make_optional<std::filesystem::path>(argv[1]) : std::nullopt;
 
   auto app = Adw::Application::create("org.kurbo96.illuminata", Gio::Application::Flags::NON_UNIQUE);
-  return app->make_window_and_run<illa::PdfViewer>(0, nullptr, *app, path);
+  return app->make_window_and_run<illa::PdfViewer>(0, nullptr, *app, path, config);
 }